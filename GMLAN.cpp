@@ -20,7 +20,7 @@ Jason Gaunt, 18th Feb 2013
 #include "GMLAN.h"
 #include <vector>
 
-void CANHeader::decode(int _header) {
+void CANHeader::decode(uint32_t _header) {
     if (_header < 0x800)
     {
         // 11-bit header
@@ -32,19 +32,13 @@ void CANHeader::decode(int _header) {
         senderID = (_header >> 0) & 0x1FFF;
     }
 }
-int CANHeader::encode29bit(void) {
-    long int buffer = 0;
-    buffer = (buffer << 3) | 0x0; // 3 bit padding
-    buffer = (buffer << 3) | priorityID;
-    buffer = (buffer << 13) | arbitrationID;
-    buffer = (buffer << 13) | senderID;
-    return buffer;
+uint32_t CANHeader::encode29bit(void) const {
+    // 3 bit padding, 3 bit priority, 13 bit arbid, 13 bit sender
+    return gmlan_encode29bit(priorityID, arbitrationID, senderID);
 }
-int CANHeader::encode11bit(void) {
-    short int buffer = 0;
-    buffer = (buffer << 5) | 0x0; // 5 bit padding
-    buffer = (buffer << 11) | arbitrationID;
-    return buffer;
+uint16_t CANHeader::encode11bit(void) const {
+    // 5 bit padding, 11 bit identifier
+    return gmlan_encode11bit(arbitrationID);
 }
 
     
@@ -53,14 +47,22 @@ int _b0, int _b1, int _b2, int _b3, int _b4, int _b5, int _b6, int _b7) {
     priority = _priority;
     arbitration = _arbitration;
     sender = _sender;
-    if (_b0 != -1) data.push_back(_b0);
-    if (_b1 != -1) data.push_back(_b1);
-    if (_b2 != -1) data.push_back(_b2);
-    if (_b3 != -1) data.push_back(_b3);
-    if (_b4 != -1) data.push_back(_b4);
-    if (_b5 != -1) data.push_back(_b5);
-    if (_b6 != -1) data.push_back(_b6);
-    if (_b7 != -1) data.push_back(_b7);
+    length = 0;
+    if (_b0 != -1) data[length++] = _b0;
+    if (_b1 != -1) data[length++] = _b1;
+    if (_b2 != -1) data[length++] = _b2;
+    if (_b3 != -1) data[length++] = _b3;
+    if (_b4 != -1) data[length++] = _b4;
+    if (_b5 != -1) data[length++] = _b5;
+    if (_b6 != -1) data[length++] = _b6;
+    if (_b7 != -1) data[length++] = _b7;
+}
+GMLAN_Message::GMLAN_Message(int _priority, int _arbitration, int _sender, const char *_data, int _length) {
+    priority = _priority;
+    arbitration = _arbitration;
+    sender = _sender;
+    length = (_length > 8) ? 8 : ((_length < 0) ? 0 : _length);
+    memcpy(data, _data, length);
 }
 CANMessage GMLAN_Message::generate(void) {
     CANHeader hdr;
@@ -68,132 +70,281 @@ CANMessage GMLAN_Message::generate(void) {
     hdr.arbitration(arbitration);
     hdr.sender(sender);
     
-    char datatochars [data.size()];
-    for (int i = 0; i < data.size(); i++) datatochars[i] = data[i];
-    
+    // CANMessage copies straight out of the inline buffer
     if (sender > 0x0)
-        return CANMessage(hdr.encode29bit(), datatochars, data.size(), CANData, CANExtended);
+        return CANMessage(hdr.encode29bit(), data, length, CANData, CANExtended);
     else
-        return CANMessage(arbitration, datatochars, data.size(), CANData, CANStandard);
+        return CANMessage(arbitration, data, length, CANData, CANStandard);
 }
 
 GMLAN_11Bit_Request::GMLAN_11Bit_Request(int _id, vector<char> _request, bool _await_response, bool _handle_flowcontrol) {
     id = _id;
     request_data = _request;
+    request_external = NULL;
+    request_length = request_data.size();
     await_response = _await_response;
     handle_flowcontrol = _handle_flowcontrol;
+    memset(frame_padding, 0xAA, 8);
+    rx_block_size = rx_separation = 0;
+    rx_external = NULL;
+    rx_external_capacity = 0;
+    rx_timeout_us = 0;
+    reset();
+}
+void GMLAN_11Bit_Request::reset(void) {
     tx_bytes = rx_bytes = 0;
     tx_frame_counter = rx_frame_counter = 1;
-    const char _fp [8] = {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA};
-    memcpy(frame_padding, _fp, 8);
+    tx_block_size = tx_block_remaining = 0;
+    tx_separation_us = tx_last_us = 0;
+    tx_separation_pending = false;
+    rx_block_remaining = 0;
+    rx_length = 0;
+    rx_last_us = 0;
+    rx_segmented = false;
     request_state = GMLAN_STATE_READY_TO_SEND;
+#ifdef GMLAN_INSTRUMENTATION
+    timeline.clear();
+#endif
+}
+void GMLAN_11Bit_Request::reset(const char *_request, int _length) {
+    request_external = _request;
+    request_length = (_length < 0) ? 0 : _length;
+    reset();
+}
+bool GMLAN_11Bit_Request::reserveResponse(int _length) {
+    rx_length = 0;
+    if (rx_external != NULL) return _length <= rx_external_capacity;
+    // One allocation for the whole response, reused if the request is run again
+    response_data.resize(_length);
+    return true;
+}
+void GMLAN_11Bit_Request::setResponseBuffer(char *_buffer, int _capacity) {
+    rx_external = _buffer;
+    rx_external_capacity = (_buffer == NULL) ? 0 : _capacity;
 }
-CANMessage GMLAN_11Bit_Request::getNextFrame(void) {
+vector<char> GMLAN_11Bit_Request::getResponse(void) {
+    const char *data = getResponseData();
+    return vector<char>(data, data + rx_length);
+}
+static uint32_t separationTimeToMicroseconds(int _separation_time) {
+    // ISO 15765-2 STmin: 0x00-0x7F milliseconds, 0xF1-0xF9 100-900 microseconds,
+    // anything else is reserved and treated as the longest legal value
+    if (_separation_time <= 0x7F) return _separation_time * 1000;
+    if ((_separation_time >= 0xF1) && (_separation_time <= 0xF9)) return (_separation_time - 0xF0) * 100;
+    return 0x7F * 1000;
+}
+bool GMLAN_11Bit_Request::frameDue(uint32_t now_us) {
+    if (request_state != GMLAN_STATE_SEND_DATA) return false;
+    // STmin only applies between consecutive frames, not after a flow control frame
+    if (!tx_separation_pending || (tx_separation_us == 0)) return true;
+    return (uint32_t)(now_us - tx_last_us) >= tx_separation_us;
+}
+CANMessage GMLAN_11Bit_Request::getNextFrame(uint32_t now_us) {
+    tx_last_us = now_us;
+    tx_separation_pending = true;
+    const char *source = requestBuffer();
+
     char datatochars [8];
     memcpy(datatochars, frame_padding, 8);
     
     if (handle_flowcontrol == true) {
         // Only run this section if we need flow control
-        if (request_data.size() < 8) {
+        if (request_length < 8) {
             // Unsegmented frame
-            datatochars[0] = (GMLAN_PCI_UNSEGMENTED << 4) | (request_data.size() & 0xF);
-            for (int i = 0; i < request_data.size(); i++) {
-                datatochars[i+1] = request_data[i];
+            datatochars[0] = (GMLAN_PCI_UNSEGMENTED << 4) | (request_length & 0xF);
+            for (int i = 0; i < request_length; i++) {
+                datatochars[i+1] = source[i];
                 tx_bytes++;
             }
-            request_state = GMLAN_STATE_AWAITING_REPLY;
+            setState(GMLAN_STATE_AWAITING_REPLY);
         } else if (tx_bytes == 0) {
             // First segmented frame
-            datatochars[0] = (GMLAN_PCI_SEGMENTED << 4) | ((request_data.size() >> 8) & 0xF);
-            datatochars[1] = request_data.size() & 0xFF;
+            datatochars[0] = (GMLAN_PCI_SEGMENTED << 4) | ((request_length >> 8) & 0xF);
+            datatochars[1] = request_length & 0xFF;
             for (int i = 0; i < 6; i++) {
-                datatochars[i+2] = request_data[i];
+                datatochars[i+2] = source[i];
                 tx_bytes++;
             }
-            request_state = GMLAN_STATE_AWAITING_FC;
-        } else if (tx_bytes <= request_data.size()) {
+            setState(GMLAN_STATE_AWAITING_FC);
+        } else if (tx_bytes <= request_length) {
             // Additional segmented frame with data left to transmit
             datatochars[0] = (GMLAN_PCI_ADDITIONAL << 4) | (tx_frame_counter & 0xF);
             int old_tx_bytes = tx_bytes;
             for (int i = old_tx_bytes; i < old_tx_bytes + 7; i++) {
-                if (i >= request_data.size()) break;
-                datatochars[(i+1)-old_tx_bytes] = request_data[i];
+                if (i >= request_length) break;
+                datatochars[(i+1)-old_tx_bytes] = source[i];
                 tx_bytes++;
             }
             tx_frame_counter++;
             if (tx_frame_counter > 0xF) tx_frame_counter = 0x0;
+            // Block used up, wait for the ECU to ask for more
+            if ((tx_block_size > 0) && (--tx_block_remaining <= 0)) setState(GMLAN_STATE_AWAITING_FC);
         }
-        if (tx_bytes >= request_data.size()) {
-            if (await_response == true) request_state = GMLAN_STATE_AWAITING_REPLY;
-            else request_state = GMLAN_STATE_COMPLETED;
+        if (tx_bytes >= request_length) {
+            if (await_response == true) setState(GMLAN_STATE_AWAITING_REPLY);
+            else setState(GMLAN_STATE_COMPLETED);
         }
     } else {
         // No flow control required, build the frames without parsing but make sure we don't overshoot 8 bytes
-        for (int i = 0; i < request_data.size(); i++) {
+        for (int i = 0; i < request_length; i++) {
             if (i < 8) {
-                datatochars[i] = request_data[i];
+                datatochars[i] = source[i];
                 tx_bytes++;
             }
             else break;
         }
-        if (await_response == true) request_state = GMLAN_STATE_AWAITING_REPLY;
-        else request_state = GMLAN_STATE_COMPLETED;
+        if (await_response == true) setState(GMLAN_STATE_AWAITING_REPLY);
+        else setState(GMLAN_STATE_COMPLETED);
     }
     
     return CANMessage(id, datatochars, 8, CANData, CANStandard);
 }
-CANMessage GMLAN_11Bit_Request::getFlowControl(void) {
-    request_state = GMLAN_STATE_AWAITING_REPLY;
-    GMLAN_Message buffer = GMLAN_Message(0x0, id, 0x0, 0x30, 0x0, 0x0);
+int GMLAN_11Bit_Request::getFrames(CANMessage *frames, int max_frames, uint32_t now_us) {
+    if ((max_frames <= 0) || (request_state != GMLAN_STATE_SEND_DATA)) return 0;
+    // Single and first frames, and requests without flow control, are one frame each
+    if ((handle_flowcontrol == false) || (request_length < 8) || (tx_bytes == 0)) {
+        frames[0] = getNextFrame(now_us);
+        return 1;
+    }
+    // A non-zero STmin needs pacing between frames, which a burst can't give
+    int window = (tx_separation_us > 0) ? 1 : max_frames;
+    if ((tx_block_size > 0) && (tx_block_remaining < window)) window = tx_block_remaining;
+    
+    const char *source = requestBuffer();
+    int total = request_length;
+    int count = 0;
+    while ((count < window) && (tx_bytes < total)) {
+        // Build each consecutive frame in place in the caller's array
+        CANMessage &frame = frames[count++];
+        int chunk = total - tx_bytes;
+        if (chunk > 7) chunk = 7;
+        frame.id = id;
+        frame.len = 8;
+        frame.format = CANStandard;
+        frame.type = CANData;
+        frame.data[0] = (GMLAN_PCI_ADDITIONAL << 4) | (tx_frame_counter & 0xF);
+        memcpy(&frame.data[1], source + tx_bytes, chunk);
+        if (chunk < 7) memset(&frame.data[1 + chunk], 0xAA, 7 - chunk);
+        tx_bytes += chunk;
+        tx_frame_counter = (tx_frame_counter + 1) & 0xF;
+    }
+    
+    tx_last_us = now_us;
+    tx_separation_pending = true;
+    if (tx_bytes >= total) {
+        if (await_response == true) setState(GMLAN_STATE_AWAITING_REPLY);
+        else setState(GMLAN_STATE_COMPLETED);
+    } else if (tx_block_size > 0) {
+        tx_block_remaining -= count;
+        if (tx_block_remaining <= 0) setState(GMLAN_STATE_AWAITING_FC);
+    }
+    return count;
+}
+CANMessage GMLAN_11Bit_Request::getFlowControl(uint32_t now_us) {
+    setState(GMLAN_STATE_AWAITING_REPLY);
+    rx_block_remaining = rx_block_size;
+    // N_Cr runs from here until the first consecutive frame of the block
+    rx_segmented = true;
+    rx_last_us = now_us;
+    GMLAN_Message buffer = GMLAN_Message(0x0, id, 0x0, (GMLAN_PCI_FLOW_CONTROL << 4), rx_block_size, rx_separation);
     return buffer.generate();
 }
-void GMLAN_11Bit_Request::processFrame(CANMessage msg) {
+bool GMLAN_11Bit_Request::checkTimeout(uint32_t now_us) {
+    // Only a segmented response part way through (our flow control sent) can stall, waiting for
+    // the first reply frame, 0x78 pending or not, is left to the caller's own timeout
+    if ((rx_timeout_us == 0) || !rx_segmented || (request_state != GMLAN_STATE_AWAITING_REPLY) || (rx_length >= rx_bytes)) return false;
+    if ((uint32_t)(now_us - rx_last_us) <= rx_timeout_us) return false;
+    setState(GMLAN_STATE_TIMEOUT);
+    return true;
+}
+void GMLAN_11Bit_Request::processFrame(const CANMessage &msg, uint32_t now_us) {
     if (((msg.id & 0xFF) == (id & 0xFF)) && 
         ((request_state == GMLAN_STATE_AWAITING_REPLY) || (request_state == GMLAN_STATE_AWAITING_FC))
     ) {
         // Only handle requests we've instigated
+#ifdef GMLAN_INSTRUMENTATION
+        timeline.frameReceived();
+#endif
         char datatochars [8];
         memcpy(datatochars, msg.data, 8);
         
         if (((datatochars[0] >> 4) & 0xF) == GMLAN_PCI_UNSEGMENTED) {
             // Unsegmented frame
-            rx_bytes = (datatochars[0] & 0xF);
+            int length = (datatochars[0] & 0xF);
+            if (length > 7) length = 7;
             if (datatochars[1] == GMLAN_SID_ERROR) {
                 // Error frame
-                if ((rx_bytes == 3) && (datatochars[3] == 0x78)) return; // "Still processing request" message, ignore this one
-                request_state = GMLAN_STATE_ERROR;
-            } else request_state = GMLAN_STATE_COMPLETED;
-            for (int i = 1; i < (rx_bytes+1); i++) response_data.push_back(datatochars[i]);
-        } else if (((datatochars[0] >> 4) & 0xF) == GMLAN_PCI_SEGMENTED) {
-            // First segmented frame
-            rx_bytes = (datatochars[0] & 0xF);
-            rx_bytes = (rx_bytes << 8) | datatochars[1];
-            for (int i = 2; i < 8; i++) {
-                if ((i - 2) >= rx_bytes) {
-                    // Safety net for incorrectly formatted packets
-                    request_state = GMLAN_STATE_COMPLETED;
+                if ((length == 3) && (datatochars[3] == 0x78)) {
+                    // "Still processing request" message, keep waiting for the real one
+#ifdef GMLAN_INSTRUMENTATION
+                    timeline.pendingResponse();
+#endif
                     return;
                 }
-                response_data.push_back(datatochars[i]);
+                setState(GMLAN_STATE_ERROR);
+            } else setState(GMLAN_STATE_COMPLETED);
+            rx_bytes = length;
+            if (!reserveResponse(rx_bytes)) {
+                setState(GMLAN_STATE_ERROR);
+                return;
+            }
+            memcpy(responseBuffer(), &datatochars[1], rx_bytes);
+            rx_length = rx_bytes;
+        } else if (((datatochars[0] >> 4) & 0xF) == GMLAN_PCI_SEGMENTED) {
+            // First segmented frame, carries the total length so size the buffer once here
+            rx_bytes = ((datatochars[0] & 0xF) << 8) | (datatochars[1] & 0xFF);
+            if (!reserveResponse(rx_bytes)) {
+                setState(GMLAN_STATE_ERROR);
+                return;
             }
-            request_state = GMLAN_STATE_SEND_FC;
+            rx_length = (rx_bytes < 6) ? rx_bytes : 6;
+            memcpy(responseBuffer(), &datatochars[2], rx_length);
+            rx_frame_counter = 1;
+            if (rx_length >= rx_bytes) {
+                // Safety net for incorrectly formatted packets
+                setState(GMLAN_STATE_COMPLETED);
+                return;
+            }
+            setState(GMLAN_STATE_SEND_FC);
         } else if (((datatochars[0] >> 4) & 0xF) == GMLAN_PCI_ADDITIONAL) {
-            // Additional segmented frame
-            // TODO check for frame order
-            for (int i = 1; i < 8; i++) {
-                if (response_data.size() >= rx_bytes) {
-                    request_state = GMLAN_STATE_COMPLETED;
-                    return;
-                }
-                response_data.push_back(datatochars[i]);
+            // Additional segmented frame, only part of a response after its first frame
+            if (rx_length >= rx_bytes) return;
+            if ((datatochars[0] & 0xF) != rx_frame_counter) {
+                // Missed or repeated frame, stop here instead of assembling a corrupted response
+                setState(GMLAN_STATE_SEQUENCE_ERROR);
+                return;
+            }
+            rx_frame_counter = (rx_frame_counter + 1) & 0xF;
+            rx_last_us = now_us;
+            int chunk = rx_bytes - rx_length;
+            if (chunk > 7) chunk = 7;
+            if (chunk > 0) {
+                memcpy(responseBuffer() + rx_length, &datatochars[1], chunk);
+                rx_length += chunk;
             }
-            if (response_data.size() >= rx_bytes) {
-                request_state = GMLAN_STATE_COMPLETED;
+            if (rx_length >= rx_bytes) {
+                setState(GMLAN_STATE_COMPLETED);
                 return;
             }
+            // End of the block we advertised, the ECU waits for another flow control
+            if ((rx_block_size > 0) && (--rx_block_remaining <= 0)) setState(GMLAN_STATE_SEND_FC);
         } else if (((datatochars[0] >> 4) & 0xF) == GMLAN_PCI_FLOW_CONTROL) {
-            // Flow control frame
-            request_state = GMLAN_STATE_SEND_DATA;
+            // Flow control frame, only meaningful while we're waiting for one
+            if (request_state != GMLAN_STATE_AWAITING_FC) return;
+            int flow_status = datatochars[0] & 0xF;
+            if (flow_status == 0x0) {
+                // Clear to send, BS of 0 means send everything without further flow control
+                tx_block_size = tx_block_remaining = datatochars[1] & 0xFF;
+                tx_separation_us = separationTimeToMicroseconds(datatochars[2] & 0xFF);
+                tx_separation_pending = false;
+                setState(GMLAN_STATE_SEND_DATA);
+            } else if (flow_status == 0x1) {
+                // Wait, another flow control frame will follow
+                return;
+            } else {
+                // Overflow or invalid, the ECU won't take this request
+                setState(GMLAN_STATE_ERROR);
+            }
         }
     }
 }
\ No newline at end of file
@@ -19,6 +19,8 @@ Jason Gaunt, 18th Feb 2013
 #include "mbed.h"
 #include "GMLAN_29bit.h"
 #include "GMLAN_11bit.h"
+#include "GMLAN_Instrumentation.h"
+#include <stdint.h>
 #include <vector>
 
 #ifndef GMLAN_H
@@ -51,46 +53,89 @@ class CANHeader {
     */
 
     private:
-        int priorityID, arbitrationID, senderID;
+        uint8_t priorityID;
+        uint16_t arbitrationID, senderID;
     
     public:
         // Main function
-        CANHeader() { }
+        CANHeader() : priorityID(0), arbitrationID(0), senderID(0) { }
         
-        // Methods for getting / setting priority, both integers
-        int priority(void) { return priorityID; }
-        void priority(int _priority) { priorityID = _priority; }
+        // Methods for getting / setting priority (3 bits)
+        int priority(void) const { return priorityID; }
+        void priority(int _priority) { priorityID = _priority & 0x7; }
         
-        // Method for getting / setting arbitration id aka arbid, both integers
-        int arbitration(void) { return arbitrationID; }
-        void arbitration(int _arbitration) { arbitrationID = _arbitration; }
+        // Method for getting / setting arbitration id aka arbid (13 bits, 11 bits for 11-bit frames)
+        int arbitration(void) const { return arbitrationID; }
+        void arbitration(int _arbitration) { arbitrationID = _arbitration & 0x1FFF; }
         
-        // Method for getting / setting sender id, both integers
-        int sender(void) { return senderID; }
-        void sender(int _sender) { senderID = _sender; }
+        // Method for getting / setting sender id (13 bits)
+        int sender(void) const { return senderID; }
+        void sender(int _sender) { senderID = _sender & 0x1FFF; }
     
         // Function to decode either an 11-bit or 29-bit header packet and store values in respective variables
-        void decode(int _header);
+        void decode(uint32_t _header);
         
-        // Function to encode stored values as 29-bit header and return header packet as int
-        int encode29bit(void);
+        // Function to encode stored values as 29-bit header and return header packet
+        uint32_t encode29bit(void) const;
 
-        // Function to encode stored values as 11-bit header and return header packet as int
-        int encode11bit(void);
+        // Function to encode stored values as 11-bit header and return header packet
+        uint16_t encode11bit(void) const;
 };
 
+/*
+Compile-time header encoding for identifiers known up front, such as the transmit
+IDs in GMLAN_29bit.h. The whole identifier folds to a constant and fields that do
+not fit the header layout are rejected when the template is instantiated:
+
+    CANMessage(gmlan_id29<0x4, GMLAN_ARBID_CHIME_COMMAND, 0x60>::value, data, 8, CANData, CANExtended);
+
+CANHeader remains the way to build identifiers that are only known at runtime.
+*/
+constexpr uint32_t gmlan_encode29bit(uint32_t _priority, uint32_t _arbitration, uint32_t _sender) {
+    return ((_priority & 0x7) << 26) | ((_arbitration & 0x1FFF) << 13) | (_sender & 0x1FFF);
+}
+constexpr uint16_t gmlan_encode11bit(uint32_t _arbitration) {
+    return _arbitration & 0x7FF;
+}
+
+template <uint32_t _priority, uint32_t _arbitration, uint32_t _sender>
+struct gmlan_id29 {
+    static_assert(_priority <= 0x7, "GMLAN priority is a 3-bit field");
+    static_assert(_arbitration <= 0x1FFF, "GMLAN arbitration ID is a 13-bit field");
+    static_assert(_sender <= 0x1FFF, "GMLAN sender ID is a 13-bit field");
+    static constexpr uint32_t value = gmlan_encode29bit(_priority, _arbitration, _sender);
+    constexpr operator uint32_t() const { return value; }
+};
+template <uint32_t _priority, uint32_t _arbitration, uint32_t _sender>
+constexpr uint32_t gmlan_id29<_priority, _arbitration, _sender>::value;
+
+template <uint32_t _arbitration>
+struct gmlan_id11 {
+    static_assert(_arbitration <= 0x7FF, "11-bit identifier out of range");
+    static constexpr uint16_t value = gmlan_encode11bit(_arbitration);
+    constexpr operator uint16_t() const { return value; }
+};
+template <uint32_t _arbitration>
+constexpr uint16_t gmlan_id11<_arbitration>::value;
+
 class GMLAN_Message {
     /*
     Wrapper for CANMessage that automatically parses settings
+    
+    The payload is held inline (a CAN frame never carries more than 8 bytes) so
+    building and generating a message never touches the heap.
     */
     private:
-        vector<char> data;
+        char data [8];
+        int length;
         int priority, arbitration, sender;
     
     public:
         // Main function
         GMLAN_Message(int _priority = -1, int _arbitration = -1, int _sender = -1,
         int _b0 = -1, int _b1 = -1, int _b2 = -1, int _b3 = -1, int _b4 = -1, int _b5 = -1, int _b6 = -1, int _b7 = -1);
+        // Build from an existing buffer, anything past 8 bytes is dropped
+        GMLAN_Message(int _priority, int _arbitration, int _sender, const char *_data, int _length);
     
         // Return result
         CANMessage generate(void);
@@ -99,37 +144,120 @@ class GMLAN_Message {
 class GMLAN_11Bit_Request {
     /*
     Class to allow easier handling of sending and receiving 11-bit messages
+    
+    Flow control is honoured in both directions. When sending, the block size (BS)
+    and separation time (STmin) from the ECU's flow control frame are applied:
+    after BS consecutive frames the request waits for the next flow control, and
+    frameDue() reports when STmin has passed since the last frame so a sender can
+    go back-to-back whenever the ECU allows it. When receiving, setFlowControl()
+    picks the BS / STmin advertised to the ECU.
+    
+    The response buffer is sized once from the length in the first frame and each
+    frame's payload is copied in as a block. getResponseData() / getResponseLength()
+    give access to it without a copy.
+    
+    Consecutive frames are checked against the expected sequence number, a gap or
+    repeat ends the request in GMLAN_STATE_SEQUENCE_ERROR as soon as it is seen
+    rather than handing back a corrupted response. With setReceiveTimeout() the
+    request also gives up with GMLAN_STATE_TIMEOUT when the next consecutive frame
+    is late, see checkTimeout(). Both are worth retrying with reset().
+    
+    With GMLAN_INSTRUMENTATION defined each run also keeps a timeline of its state
+    changes and reports its latencies to gmlan_latency (GMLAN_Instrumentation.h).
     */
     private:
         vector<char> request_data, response_data;
+        const char *request_external;
+        int request_length;
         int id, request_state;
         int tx_frame_counter, tx_bytes;
         int rx_frame_counter, rx_bytes;
         bool await_response, handle_flowcontrol;
         char frame_padding [8];
+        int tx_block_size, tx_block_remaining;
+        uint32_t tx_separation_us, tx_last_us;
+        bool tx_separation_pending;
+        int rx_block_size, rx_block_remaining, rx_separation;
+        int rx_length, rx_external_capacity;
+        char *rx_external;
+        uint32_t rx_timeout_us, rx_last_us;
+        // Flow control sent for a segmented response, N_Cr applies from here on
+        bool rx_segmented;
+        
+        const char *requestBuffer(void) { return (request_external != NULL) ? request_external : (request_data.empty() ? NULL : &request_data[0]); }
+        bool reserveResponse(int _length);
+        char *responseBuffer(void) { return (rx_external != NULL) ? rx_external : (response_data.empty() ? NULL : &response_data[0]); }
+#ifdef GMLAN_INSTRUMENTATION
+        GMLAN_RequestTimeline timeline;
+#endif
+        // Every state change goes through here so instrumentation sees it
+        void setState(int _state) {
+#ifdef GMLAN_INSTRUMENTATION
+            if (_state != request_state) timeline.transition(id, request_state, _state);
+#endif
+            request_state = _state;
+        }
     
     public:
         // (Main function) Create message and send it
         GMLAN_11Bit_Request(int _id, vector<char> _request, bool _await_response = true, bool _handle_flowcontrol = true);
         
-        // Process each frame to transmit and flow control frame if needed
-        CANMessage getNextFrame(void);
-        CANMessage getFlowControl(void);
-        // Process each received frame
-        void processFrame(CANMessage msg);
+        // Process each frame to transmit and flow control frame if needed, pass the
+        // current time in microseconds when pacing with frameDue()
+        CANMessage getNextFrame(uint32_t now_us = 0);
+        CANMessage getFlowControl(void) { return getFlowControl(rx_timeout_us ? us_ticker_read() : 0); }
+        CANMessage getFlowControl(uint32_t now_us);
+        // Segment as much of the request as the ECU's current block allows into frames[] in one
+        // pass, for handing straight to a transmit FIFO. Returns the number of frames written
+        int getFrames(CANMessage *frames, int max_frames, uint32_t now_us = 0);
+        // True when in GMLAN_STATE_SEND_DATA and the ECU's STmin has elapsed
+        bool frameDue(uint32_t now_us);
+        // Block size and STmin (raw ISO 15765 encoding) to advertise when receiving, defaults to 0 / 0
+        void setFlowControl(int _block_size, int _separation_time) { rx_block_size = _block_size & 0xFF; rx_separation = _separation_time & 0xFF; }
+        // Limits negotiated by the ECU for our transmission, STmin converted to microseconds
+        int getBlockSize(void) { return tx_block_size; }
+        uint32_t getSeparationTime(void) { return tx_separation_us; }
+        // Process each received frame, pass the current time in microseconds when using checkTimeout()
+        // with a clock other than us_ticker_read()
+        void processFrame(const CANMessage &msg) { processFrame(msg, rx_timeout_us ? us_ticker_read() : 0); }
+        void processFrame(const CANMessage &msg, uint32_t now_us);
+        // Longest gap allowed between our flow control and a consecutive frame or between two
+        // consecutive frames (N_Cr), 0 (the default) never times out
+        void setReceiveTimeout(uint32_t _timeout_us) { rx_timeout_us = _timeout_us; }
+        // Move to GMLAN_STATE_TIMEOUT if a segmented response has stalled, returns true when it did
+        bool checkTimeout(uint32_t now_us);
         
         // Handle starting and flow control
-        void start(void) { request_state = GMLAN_STATE_SEND_DATA; }
-        void continueFlow(void) { request_state = GMLAN_STATE_SEND_DATA; }
+        void start(void) { setState(GMLAN_STATE_SEND_DATA); }
+        void continueFlow(void) { setState(GMLAN_STATE_SEND_DATA); }
+        // Run the same request again from the start
+        void reset(void);
+        // Reuse this object for a new request, sending straight from _request (at most 4095 bytes)
+        // without copying it. The caller keeps the memory valid until the request finishes
+        void reset(const char *_request, int _length);
+        // Give up on the request, e.g. when the ECU never answers
+        void abort(void) { setState(GMLAN_STATE_ERROR); }
         
         // Return request_state to confirm status
         int getState(void) { return request_state; }
+        // Lost frame or receive timeout, the ECU answered but the response didn't make it intact
+        bool receiveFailed(void) { return (request_state == GMLAN_STATE_SEQUENCE_ERROR) || (request_state == GMLAN_STATE_TIMEOUT); }
         // Return ID
         int getID(void) { return id; }
         // Return rx_bytes
         int getRXcount(void) { return rx_bytes; }
-        // Return response
-        vector<char> getResponse(void) { return response_data; }
+        // Return a copy of the response
+        vector<char> getResponse(void);
+        // Non-owning view of the response, valid until the request is destroyed or receives again
+        const char *getResponseData(void) { return responseBuffer(); }
+        int getResponseLength(void) { return rx_length; }
+        // Receive into caller owned storage (a pool block, an arena slice...) instead of the heap,
+        // a response longer than _capacity puts the request into GMLAN_STATE_ERROR
+        void setResponseBuffer(char *_buffer, int _capacity);
+#ifdef GMLAN_INSTRUMENTATION
+        // State transitions, first frame / flow control timings and 0x78 count of the current run
+        const GMLAN_RequestTimeline &getTimeline(void) { return timeline; }
+#endif
 };
 
 #endif
\ No newline at end of file
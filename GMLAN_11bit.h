@@ -79,6 +79,13 @@ Jason Gaunt, 18th Feb 2013
 #define GMLAN_SID_REQ_DPID          0xAA
 #define GMLAN_SID_REQ_CONTROL       0xAE
 
+// Transmission rates for GMLAN_SID_REQ_DPID
+#define GMLAN_DPID_RATE_STOP        0x0
+#define GMLAN_DPID_RATE_ONE_SHOT    0x1
+#define GMLAN_DPID_RATE_SLOW        0x2
+#define GMLAN_DPID_RATE_MEDIUM      0x3
+#define GMLAN_DPID_RATE_FAST        0x4
+
 // States of request
 #define GMLAN_STATE_READY_TO_SEND   0x0
 #define GMLAN_STATE_SEND_DATA       0x1
@@ -87,5 +94,9 @@ Jason Gaunt, 18th Feb 2013
 #define GMLAN_STATE_SEND_FC         0x4
 #define GMLAN_STATE_COMPLETED       0x5
 #define GMLAN_STATE_ERROR           0x6
+// Consecutive frame lost or out of order, the response so far is unusable
+#define GMLAN_STATE_SEQUENCE_ERROR  0x7
+// No consecutive frame within the receive timeout (ISO 15765 N_Cr)
+#define GMLAN_STATE_TIMEOUT         0x8
 
 #endif
\ No newline at end of file
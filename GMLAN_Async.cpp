@@ -0,0 +1,149 @@
+/*
+GMLAN_Async.cpp - Coroutine request API for GMLAN Library
+
+Event loop driving coroutine tasks over a session manager and a transport.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Async.h"
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+
+#include <algorithm>
+
+// Frames moved per transport call
+#define GMLAN_ASYNC_BATCH 32
+// Longest run() blocks while requests are in flight, bounds STmin and expiry latency
+#define GMLAN_ASYNC_MAX_WAIT_MS 1
+
+// Earliest deadline at the top of the heap, wrap safe
+static bool laterTimer(const uint32_t &a, const uint32_t &b) { return (int32_t)(a - b) > 0; }
+
+GMLAN_EventLoop::GMLAN_EventLoop(GMLAN_Transport &_bus, uint32_t _timeout_us) : bus(_bus), timeout(_timeout_us) {
+    sessions.onComplete(completed, this);
+}
+GMLAN_EventLoop::~GMLAN_EventLoop() {
+    for (size_t i = 0; i < tasks.size(); i++) tasks[i].destroy();
+}
+void GMLAN_EventLoop::spawn(GMLAN_Task &&_task) {
+    if (!_task.handle) return;
+    tasks.push_back(_task.handle);
+    ready.push_back(_task.handle);
+    _task.handle = nullptr;
+}
+bool GMLAN_EventLoop::submit(int _id, const vector<char> &_payload, std::coroutine_handle<> _waiter, GMLAN_Response *_result) {
+    int handle = sessions.submit(_id, _payload);
+    if (handle < 0) {
+        // Couldn't queue it, resume straight away with the failure
+        _result->state = GMLAN_STATE_ERROR;
+        _result->nrc = 0;
+        _result->data.clear();
+        return false;
+    }
+    if (handle >= (int)waiting.size()) waiting.resize(handle + 1);
+    waiting[handle].handle = _waiter;
+    waiting[handle].result = _result;
+    return true;
+}
+void GMLAN_EventLoop::addTimer(uint32_t _us, std::coroutine_handle<> _waiter) {
+    Timer t = { us_ticker_read() + _us, _waiter };
+    timers.push_back(t);
+    std::push_heap(timers.begin(), timers.end(), [](const Timer &a, const Timer &b) { return laterTimer(a.deadline, b.deadline); });
+}
+void GMLAN_EventLoop::completed(int _handle, GMLAN_11Bit_Request & /*_request*/, void *_context) {
+    // Called from inside the session manager, the task is resumed later from poll()
+    ((GMLAN_EventLoop *)_context)->finished.push_back(_handle);
+}
+bool GMLAN_EventLoop::collect(void) {
+    if (finished.empty()) return false;
+    for (size_t i = 0; i < finished.size(); i++) {
+        int handle = finished[i];
+        GMLAN_11Bit_Request *req = sessions.getRequest(handle);
+        Waiter &w = waiting[handle];
+        GMLAN_Response &result = *w.result;
+        
+        result.state = req->getState();
+        const char *data = req->getResponseData();
+        int length = req->getResponseLength();
+        result.data.assign(data, data + length);
+        result.nrc = ((length >= 3) && (data[0] == GMLAN_SID_ERROR)) ? (data[2] & 0xFF) : 0;
+        
+        ready.push_back(w.handle);
+        w.handle = nullptr;
+        sessions.release(handle);
+    }
+    finished.clear();
+    return true;
+}
+bool GMLAN_EventLoop::fireTimers(uint32_t _now) {
+    bool fired = false;
+    while (!timers.empty() && !laterTimer(timers.front().deadline, _now)) {
+        std::pop_heap(timers.begin(), timers.end(), [](const Timer &a, const Timer &b) { return laterTimer(a.deadline, b.deadline); });
+        ready.push_back(timers.back().handle);
+        timers.pop_back();
+        fired = true;
+    }
+    return fired;
+}
+bool GMLAN_EventLoop::resume(void) {
+    if (ready.empty()) return false;
+    // Tasks resumed here may make others ready, those wait for the next pass
+    vector<std::coroutine_handle<> > batch;
+    batch.swap(ready);
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].resume();
+        if (!batch[i].done()) continue;
+        for (size_t t = 0; t < tasks.size(); t++) {
+            if (tasks[t].address() != batch[i].address()) continue;
+            tasks[t].destroy();
+            tasks.erase(tasks.begin() + t);
+            break;
+        }
+    }
+    return true;
+}
+bool GMLAN_EventLoop::poll(void) {
+    bool progress = false;
+    progress |= fireTimers(us_ticker_read());
+    progress |= resume();
+    
+    // Transmit, anything the transport couldn't take goes first next time
+    CANMessage msg;
+    while ((tx_backlog.size() < GMLAN_ASYNC_BATCH) && sessions.getNextFrame(msg)) tx_backlog.push_back(msg);
+    if (!tx_backlog.empty()) {
+        int sent = bus.write(&tx_backlog[0], tx_backlog.size());
+        tx_backlog.erase(tx_backlog.begin(), tx_backlog.begin() + sent);
+        progress |= (sent > 0);
+    }
+    
+    // Receive
+    CANMessage frames [GMLAN_ASYNC_BATCH];
+    int count;
+    while ((count = bus.read(frames, GMLAN_ASYNC_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) sessions.processFrame(frames[i]);
+        progress = true;
+    }
+    sessions.expire(timeout);
+    
+    progress |= collect();
+    progress |= resume();
+    return progress;
+}
+void GMLAN_EventLoop::run(void) {
+    while (!tasks.empty()) {
+        if (poll()) continue;
+        // Nothing to do, sleep until a frame arrives or the next timer is due
+        int wait_ms = -1;
+        if ((sessions.active() > 0) || !tx_backlog.empty()) wait_ms = GMLAN_ASYNC_MAX_WAIT_MS;
+        if (!timers.empty()) {
+            int32_t until = timers.front().deadline - us_ticker_read();
+            int timer_ms = (until <= 0) ? 0 : (until + 999) / 1000;
+            if ((wait_ms < 0) || (timer_ms < wait_ms)) wait_ms = timer_ms;
+        }
+        // Nothing pending at all would be a task waiting on something that can't happen
+        if (wait_ms < 0) break;
+        bus.wait(wait_ms);
+    }
+}
+
+#endif
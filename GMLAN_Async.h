@@ -0,0 +1,171 @@
+/*
+GMLAN_Async.h - Coroutine request API for GMLAN Library
+
+Lets diagnostic conversations be written as straight line C++20 coroutines:
+
+    GMLAN_Task readVIN(GMLAN_EventLoop &loop) {
+        GMLAN_Response vin = co_await loop.request(GMLAN_TO_BCM, read_vin);
+        if (vin.ok()) ...
+        else if (vin.nrc == GMLAN_NRC_REQUEST_OUT_OF_RANGE) ...
+        co_await loop.sleep(100000);
+    }
+    
+    GMLAN_EventLoop loop(bus);
+    loop.spawn(readVIN(loop));
+    loop.run();
+
+One GMLAN_EventLoop multiplexes every outstanding request and timer over one
+GMLAN_Transport on a single thread, any number of tasks can be suspended at once.
+Only built when the compiler supports coroutines (C++20), otherwise this header
+is empty.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_SessionManager.h"
+#include "GMLAN_Transport.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_ASYNC_H
+#define GMLAN_ASYNC_H
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+class GMLAN_EventLoop;
+
+struct GMLAN_Response {
+    /*
+    Outcome of a request. state is GMLAN_STATE_COMPLETED or an error state
+    (GMLAN_STATE_SEQUENCE_ERROR / GMLAN_STATE_TIMEOUT once the retries ran
+    out), nrc is the ECU's negative response code (0 if it answered
+    positively, never answered or the request could not be sent), data the
+    response as received
+    */
+    int state;
+    int nrc;
+    vector<char> data;
+    
+    bool ok(void) const { return state == GMLAN_STATE_COMPLETED; }
+};
+
+class GMLAN_Task {
+    /*
+    A coroutine run by GMLAN_EventLoop::spawn(), which takes ownership of it.
+    Tasks start when the loop first gets to them and are destroyed once they
+    return. Built without exceptions in mind, one escaping a task terminates.
+    */
+    public:
+        struct promise_type {
+            GMLAN_Task get_return_object(void) { return GMLAN_Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend(void) noexcept { return std::suspend_always(); }
+            std::suspend_always final_suspend(void) noexcept { return std::suspend_always(); }
+            void return_void(void) { }
+            void unhandled_exception(void) { std::terminate(); }
+        };
+        
+        GMLAN_Task(GMLAN_Task &&other) : handle(other.handle) { other.handle = nullptr; }
+        GMLAN_Task(const GMLAN_Task &) = delete;
+        GMLAN_Task &operator=(const GMLAN_Task &) = delete;
+        ~GMLAN_Task() { if (handle) handle.destroy(); }
+    
+    private:
+        friend class GMLAN_EventLoop;
+        std::coroutine_handle<promise_type> handle;
+        
+        explicit GMLAN_Task(std::coroutine_handle<promise_type> _handle) : handle(_handle) { }
+};
+
+class GMLAN_EventLoop {
+    /*
+    Requests are handed to a GMLAN_SessionManager, so conversations with different
+    ECUs overlap and those to the same ECU queue behind each other. Each poll()
+    sends whatever frames the sessions have due in one batch, routes everything
+    received, expires sessions the ECU stopped answering, fires due timers and
+    resumes the tasks whose requests or timers finished. Times are us_ticker_read().
+    
+    run() keeps polling until no task is left, blocking in GMLAN_Transport::wait()
+    whenever nothing is due.
+    */
+    public:
+        class RequestAwaiter {
+            private:
+                GMLAN_EventLoop &loop;
+                int id;
+                vector<char> payload;
+                GMLAN_Response result;
+            
+            public:
+                RequestAwaiter(GMLAN_EventLoop &_loop, int _id, vector<char> &&_payload) : loop(_loop), id(_id), payload(std::move(_payload)) { }
+                bool await_ready(void) { return false; }
+                bool await_suspend(std::coroutine_handle<> _waiter) { return loop.submit(id, payload, _waiter, &result); }
+                GMLAN_Response await_resume(void) { return std::move(result); }
+        };
+        class SleepAwaiter {
+            private:
+                GMLAN_EventLoop &loop;
+                uint32_t duration;
+            
+            public:
+                SleepAwaiter(GMLAN_EventLoop &_loop, uint32_t _us) : loop(_loop), duration(_us) { }
+                bool await_ready(void) { return duration == 0; }
+                void await_suspend(std::coroutine_handle<> _waiter) { loop.addTimer(duration, _waiter); }
+                void await_resume(void) { }
+        };
+        
+        // Main function, sessions silent for _timeout_us are aborted
+        GMLAN_EventLoop(GMLAN_Transport &_bus, uint32_t _timeout_us = 250000);
+        ~GMLAN_EventLoop();
+        
+        // co_await'able request to an ECU, resumes with its GMLAN_Response
+        RequestAwaiter request(int _id, vector<char> _payload) { return RequestAwaiter(*this, _id, std::move(_payload)); }
+        // co_await'able delay
+        SleepAwaiter sleep(uint32_t _us) { return SleepAwaiter(*this, _us); }
+        
+        // Hand a task to the loop, it starts on the next poll()
+        void spawn(GMLAN_Task &&_task);
+        // One pass over the bus, timers and tasks, returns true if anything happened
+        bool poll(void);
+        // Poll until every task has returned
+        void run(void);
+        
+        // Tasks not yet returned
+        int active(void) { return tasks.size(); }
+        // Sessions, e.g. for onComplete() statistics
+        GMLAN_SessionManager &getSessions(void) { return sessions; }
+    
+    private:
+        struct Waiter {
+            std::coroutine_handle<> handle;
+            GMLAN_Response *result;
+        };
+        struct Timer {
+            uint32_t deadline;
+            std::coroutine_handle<> handle;
+        };
+        
+        GMLAN_Transport &bus;
+        GMLAN_SessionManager sessions;
+        uint32_t timeout;
+        vector<std::coroutine_handle<GMLAN_Task::promise_type> > tasks;
+        vector<Waiter> waiting;
+        vector<int> finished;
+        vector<Timer> timers;
+        vector<std::coroutine_handle<> > ready;
+        vector<CANMessage> tx_backlog;
+        
+        bool submit(int _id, const vector<char> &_payload, std::coroutine_handle<> _waiter, GMLAN_Response *_result);
+        void addTimer(uint32_t _us, std::coroutine_handle<> _waiter);
+        bool collect(void);
+        bool fireTimers(uint32_t _now);
+        bool resume(void);
+        static void completed(int _handle, GMLAN_11Bit_Request &_request, void *_context);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+/*
+GMLAN_ChangeFilter.cpp - Change-only delivery for GMLAN Library
+
+Open addressed payload table and the accept test.
+*/
+
+#include "mbed.h"
+#include "GMLAN_ChangeFilter.h"
+
+GMLAN_ChangeFilter::GMLAN_ChangeFilter(int _capacity, uint32_t _stale_us) {
+    uint32_t size = 8;
+    shift = 29;
+    while ((int)size < _capacity) {
+        size <<= 1;
+        shift--;
+    }
+    table.resize(size);
+    mask = size - 1;
+    stale_us = _stale_us;
+    seen = forwarded = untracked = 0;
+    clear();
+}
+void GMLAN_ChangeFilter::clear(void) {
+    for (size_t i = 0; i < table.size(); i++) table[i].key = 0;
+    used = 0;
+}
+bool GMLAN_ChangeFilter::accept(const CANMessage &msg, uint32_t _now_us) {
+    seen++;
+    if ((msg.format != CANExtended) || (msg.type != CANData)) {
+        forwarded++;
+        return true;
+    }
+    
+    // Drop the priority bits, keep arbitration ID and sender
+    uint32_t key = (msg.id & 0x3FFFFFF) + 1;
+    int length = (msg.len > 8) ? 8 : msg.len;
+    uint64_t payload = 0;
+    memcpy(&payload, msg.data, length);
+    
+    // Fibonacci hashing spreads the clustered arbitration IDs over the table
+    uint32_t i = (key * 2654435769u) >> shift;
+    for (uint32_t probe = 0; probe <= mask; probe++, i++) {
+        Slot &slot = table[i & mask];
+        if (slot.key == key) {
+            if ((slot.payload == payload) && (slot.length == length) &&
+                ((stale_us == 0) || ((uint32_t)(_now_us - slot.forwarded_us) < stale_us))) return false;
+            slot.payload = payload;
+            slot.length = length;
+            slot.forwarded_us = _now_us;
+            forwarded++;
+            return true;
+        }
+        if (slot.key == 0) {
+            // New pair, only track it while the table stays sparse enough to probe quickly
+            if ((used + 1) * 4 > (mask + 1) * 3) break;
+            slot.key = key;
+            slot.payload = payload;
+            slot.length = length;
+            slot.forwarded_us = _now_us;
+            used++;
+            forwarded++;
+            return true;
+        }
+    }
+    untracked++;
+    forwarded++;
+    return true;
+}
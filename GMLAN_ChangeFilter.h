@@ -0,0 +1,73 @@
+/*
+GMLAN_ChangeFilter.h - Change-only delivery for GMLAN Library
+
+Most 29-bit traffic (door status, lighting status, climate status...) repeats
+the same payload every cycle. Passing frames through this filter before decoding
+or dispatching them drops the repeats, so upper layers only see a frame when its
+content changed or when it hasn't been seen for a while.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_CHANGEFILTER_H
+#define GMLAN_CHANGEFILTER_H
+
+class GMLAN_ChangeFilter {
+    /*
+    The last payload of each (arbitration ID, sender) pair is kept in an open
+    addressed table with linear probing, the payload packed into one 64-bit word
+    so a repeat costs a hash, usually one probe and a single compare. Priority is
+    ignored, a frame re-sent at another priority with the same content is still a
+    repeat.
+    
+    Only 29-bit data frames are filtered. 11-bit frames carry diagnostic
+    conversations where a repeated frame still means something, they and remote
+    frames always pass. The table is sized up front and never grows, once it is
+    three quarters full frames from new pairs pass untracked.
+    
+    Example:
+    
+        GMLAN_ChangeFilter changes(128, 500000);
+        while (can.read(msg)) {
+            if (changes.accept(msg, us_ticker_read())) dispatcher.dispatch(msg);
+        }
+    */
+    private:
+        struct Slot {
+            uint32_t key;       // (arbitration << 13 | sender) + 1, 0 marks an empty slot
+            uint32_t forwarded_us;
+            uint64_t payload;
+            uint8_t length;
+        };
+        
+        vector<Slot> table;
+        uint32_t mask, used, stale_us;
+        int shift;
+        uint32_t seen, forwarded, untracked;
+    
+    public:
+        // Main function, _capacity is rounded up to a power of two, a frame older than
+        // _stale_us passes even when unchanged (0 never lets repeats through)
+        GMLAN_ChangeFilter(int _capacity = 256, uint32_t _stale_us = 1000000);
+        
+        // True if the frame should be passed on
+        bool accept(const CANMessage &msg, uint32_t _now_us);
+        // Forget every payload, the next frame of each pair passes
+        void clear(void);
+        void setStaleTimeout(uint32_t _stale_us) { stale_us = _stale_us; }
+        
+        // Pairs tracked, frames seen / passed on / passed because the table was full
+        int size(void) { return used; }
+        uint32_t getSeen(void) { return seen; }
+        uint32_t getForwarded(void) { return forwarded; }
+        uint32_t getSuppressed(void) { return seen - forwarded; }
+        uint32_t getUntracked(void) { return untracked; }
+        // Fraction of frames dropped as repeats
+        float getSuppressionRatio(void) { return seen ? (float)(seen - forwarded) / seen : 0.0f; }
+        void resetStats(void) { seen = forwarded = untracked = 0; }
+};
+
+#endif
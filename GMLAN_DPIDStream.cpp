@@ -0,0 +1,131 @@
+/*
+GMLAN_DPIDStream.cpp - Dynamic PID streaming for GMLAN Library
+
+Packs PIDs into dynamically defined PIDs, builds the requests that set them up
+and decodes the resulting periodic $5xx frames back into PID values.
+*/
+
+#include "mbed.h"
+#include "GMLAN_DPIDStream.h"
+#include <algorithm>
+
+// Data bytes in one DPID frame, the first byte carries the DPID number
+#define GMLAN_DPID_PAYLOAD 7
+
+GMLAN_DPIDStream::GMLAN_DPIDStream(int _id, int _first_dpid) {
+    id = _id;
+    first_dpid = _first_dpid & 0xFF;
+    memset(lookup, 0, sizeof(lookup));
+    callback = NULL;
+    callback_context = NULL;
+    frames = samples = 0;
+}
+bool GMLAN_DPIDStream::addPID(int _pid, int _size) {
+    if ((_size < 1) || (_size > GMLAN_DPID_PAYLOAD)) return false;
+    Item item = { _pid & 0xFFFF, _size, false, 0 };
+    items.push_back(item);
+    return true;
+}
+bool GMLAN_DPIDStream::addAddress(int _pid, uint32_t _address, int _size) {
+    if ((_size < 1) || (_size > GMLAN_DPID_PAYLOAD)) return false;
+    Item item = { _pid & 0xFFFF, _size, true, _address };
+    items.push_back(item);
+    return true;
+}
+static bool largerItem(const int &a, const int &b) {
+    return (a >> 16) > (b >> 16);
+}
+int GMLAN_DPIDStream::pack(void) {
+    dpids.clear();
+    unpacked.clear();
+    memset(lookup, 0, sizeof(lookup));
+    
+    // Order item indexes by size, largest first (size in the top half, index in the bottom)
+    vector<int> order;
+    for (size_t i = 0; i < items.size(); i++) order.push_back((items[i].size << 16) | i);
+    std::stable_sort(order.begin(), order.end(), largerItem);
+    
+    for (size_t o = 0; o < order.size(); o++) {
+        const Item &item = items[order[o] & 0xFFFF];
+        size_t d = 0;
+        while ((d < dpids.size()) && (dpids[d].used + item.size > GMLAN_DPID_PAYLOAD)) d++;
+        if (d == dpids.size()) {
+            int number = first_dpid - d;
+            if (number <= 0) {
+                // Out of DPID numbers, smaller PIDs may still fit the ones already defined
+                unpacked.push_back(item.pid);
+                continue;
+            }
+            DPID dpid;
+            dpid.number = number;
+            dpid.used = 0;
+            dpids.push_back(dpid);
+        }
+        Slot slot = { item.pid, (uint8_t)dpids[d].used, (uint8_t)item.size };
+        dpids[d].slots.push_back(slot);
+        dpids[d].used += item.size;
+    }
+    
+    // Frame decode looks DPIDs up by number
+    for (size_t d = 0; d < dpids.size(); d++) lookup[dpids[d].number] = d + 1;
+    return dpids.size();
+}
+int GMLAN_DPIDStream::getSetupCount(void) {
+    int count = dpids.size();
+    for (size_t i = 0; i < items.size(); i++) if (items[i].by_address) count++;
+    return count;
+}
+vector<char> GMLAN_DPIDStream::getSetupRequest(int _index) {
+    vector<char> request;
+    // Address based PIDs have to exist before a DPID can refer to them
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!items[i].by_address) continue;
+        if (_index-- == 0) {
+            const Item &item = items[i];
+            request.push_back(GMLAN_SID_DEF_PID_BY_ADDR);
+            request.push_back((item.pid >> 8) & 0xFF);
+            request.push_back(item.pid & 0xFF);
+            request.push_back((item.address >> 24) & 0xFF);
+            request.push_back((item.address >> 16) & 0xFF);
+            request.push_back((item.address >> 8) & 0xFF);
+            request.push_back(item.address & 0xFF);
+            request.push_back(item.size);
+            return request;
+        }
+    }
+    if ((_index < 0) || (_index >= (int)dpids.size())) return request;
+    
+    const DPID &dpid = dpids[_index];
+    request.push_back(GMLAN_SID_DEF_DPID_MSG);
+    request.push_back(dpid.number);
+    for (size_t s = 0; s < dpid.slots.size(); s++) {
+        request.push_back((dpid.slots[s].pid >> 8) & 0xFF);
+        request.push_back(dpid.slots[s].pid & 0xFF);
+    }
+    return request;
+}
+vector<char> GMLAN_DPIDStream::getStartRequest(int _rate) {
+    vector<char> request;
+    request.push_back(GMLAN_SID_REQ_DPID);
+    request.push_back(_rate);
+    for (size_t d = 0; d < dpids.size(); d++) request.push_back(dpids[d].number);
+    return request;
+}
+bool GMLAN_DPIDStream::processFrame(const CANMessage &msg) {
+    // Streamed DPIDs come back unsegmented on $5xx for the same ECU
+    if ((msg.format != CANStandard) || ((msg.id & 0xF00) != 0x500) || ((msg.id & 0xFF) != (uint32_t)(id & 0xFF))) return false;
+    if (msg.len < 1) return false;
+    int slot = lookup[msg.data[0]];
+    if (slot == 0) return false;
+    
+    const DPID &dpid = dpids[slot - 1];
+    frames++;
+    for (size_t s = 0; s < dpid.slots.size(); s++) {
+        const Slot &value = dpid.slots[s];
+        // Short frames only deliver the values they actually carry
+        if (1 + value.offset + value.size > msg.len) break;
+        samples++;
+        if (callback != NULL) callback(value.pid, (const char *)&msg.data[1 + value.offset], value.size, callback_context);
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+GMLAN_DPIDStream.h - Dynamic PID streaming for GMLAN Library
+
+Rather than polling each value with GMLAN_SID_REQ_PID, PIDs are packed into
+dynamically defined PIDs (DPIDs) with GMLAN_SID_DEF_DPID_MSG and the ECU is asked
+to broadcast them periodically with GMLAN_SID_REQ_DPID. Each DPID arrives as one
+unsolicited frame on $5xx carrying the DPID number and up to 7 bytes of data, which
+this class splits back into the original PIDs.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_DPIDSTREAM_H
+#define GMLAN_DPIDSTREAM_H
+
+// Called for every PID value carried by a streamed frame, data points into the frame
+typedef void (*GMLAN_PIDCallback)(int pid, const char *data, int length, void *context);
+
+class GMLAN_DPIDStream {
+    /*
+    PIDs are packed into as few DPIDs as possible (first fit, largest first) so one
+    frame carries several values. The setup requests must be sent, in order, before
+    the start request; the session manager or plain GMLAN_11Bit_Requests can carry them.
+    
+    Example:
+    
+        GMLAN_DPIDStream stream(GMLAN_TO_BCM);
+        stream.addPID(0x1234, 2);
+        stream.addPID(0x4321, 1);
+        stream.onData(log_value);
+        stream.pack();
+        for (int i = 0; i < stream.getSetupCount(); i++) sessions.submit(GMLAN_TO_BCM, stream.getSetupRequest(i));
+        sessions.submit(GMLAN_TO_BCM, stream.getStartRequest(GMLAN_DPID_RATE_FAST));
+        ...
+        while (can.read(msg)) stream.processFrame(msg);
+    */
+    private:
+        struct Item {
+            int pid, size;
+            bool by_address;
+            uint32_t address;
+        };
+        struct Slot {
+            int pid;
+            uint8_t offset, size;
+        };
+        struct DPID {
+            int number, used;
+            vector<Slot> slots;
+        };
+        
+        int id, first_dpid;
+        vector<Item> items;
+        vector<DPID> dpids;
+        vector<int> unpacked;
+        uint8_t lookup [256];
+        GMLAN_PIDCallback callback;
+        void *callback_context;
+        uint32_t frames, samples;
+    
+    public:
+        // Main function, _id is the ECU's request ID (e.g. GMLAN_TO_BCM), DPIDs are numbered down from _first_dpid
+        GMLAN_DPIDStream(int _id, int _first_dpid = 0xFE);
+        
+        // Stream a PID of _size bytes (1-7), returns false if it can't fit a frame
+        bool addPID(int _pid, int _size);
+        // Stream memory at _address by first defining it as _pid with GMLAN_SID_DEF_PID_BY_ADDR
+        bool addAddress(int _pid, uint32_t _address, int _size);
+        // Assign PIDs to DPIDs, returns the number of DPIDs needed. PIDs that don't fit once the
+        // DPID numbers run out are left to getUnpacked()
+        int pack(void);
+        // PIDs the last pack() couldn't place, to be polled with GMLAN_SID_REQ_PID instead
+        const vector<int> &getUnpacked(void) { return unpacked; }
+        
+        // Requests that define the DPIDs ($2D then $2C), to be sent in order
+        int getSetupCount(void);
+        vector<char> getSetupRequest(int _index);
+        // Start periodic transmission at one of the GMLAN_DPID_RATE_* rates, or stop it
+        vector<char> getStartRequest(int _rate);
+        vector<char> getStopRequest(void) { return getStartRequest(GMLAN_DPID_RATE_STOP); }
+        
+        // Handle a received frame, returns true if it was one of our DPIDs
+        bool processFrame(const CANMessage &msg);
+        void onData(GMLAN_PIDCallback _callback, void *_context = NULL) { callback = _callback; callback_context = _context; }
+        
+        // DPID frames decoded and PID values delivered so far
+        uint32_t getFrameCount(void) { return frames; }
+        uint32_t getSampleCount(void) { return samples; }
+};
+
+#endif
@@ -0,0 +1,79 @@
+/*
+GMLAN_Dispatcher.cpp - Arbitration ID dispatch for GMLAN Library
+
+Routes incoming 29-bit frames to callbacks registered against an arbitration ID,
+or an arbitration ID from one particular sender, in place of hand written if/else
+chains over the GMLAN_ARBID_* values.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Dispatcher.h"
+
+GMLAN_Dispatcher::GMLAN_Dispatcher() {
+    // Directory entries hold page number + 1, zero meaning no page yet
+    memset(directory, 0, sizeof(directory));
+    fallback = NULL;
+    fallback_context = NULL;
+}
+int16_t *GMLAN_Dispatcher::slot(int _arbitration, bool _create) {
+    int page = (_arbitration >> PAGE_BITS) & (PAGE_COUNT - 1);
+    if (directory[page] == 0) {
+        if (!_create) return NULL;
+        pages.insert(pages.end(), PAGE_SIZE, -1);
+        directory[page] = pages.size() / PAGE_SIZE;
+    }
+    return &pages[((directory[page] - 1) * PAGE_SIZE) + (_arbitration & (PAGE_SIZE - 1))];
+}
+bool GMLAN_Dispatcher::subscribe(int _arbitration, GMLAN_Handler _handler, void *_context, int _sender) {
+    if ((_arbitration < 0) || (_arbitration > 0x1FFF) || (_sender > 0x1FFF) || (_handler == NULL)) return false;
+    if (subscriptions.size() >= 0x7FFF) return false;
+    
+    int16_t *head = slot(_arbitration, true);
+    Subscription sub;
+    sub.handler = _handler;
+    sub.context = _context;
+    sub.sender = (_sender < 0) ? -1 : _sender;
+    sub.next = *head;
+    subscriptions.push_back(sub);
+    *head = subscriptions.size() - 1;
+    return true;
+}
+bool GMLAN_Dispatcher::unsubscribe(int _arbitration, GMLAN_Handler _handler, void *_context, int _sender) {
+    if ((_arbitration < 0) || (_arbitration > 0x1FFF)) return false;
+    int16_t *head = slot(_arbitration, false);
+    if (head == NULL) return false;
+    
+    if (_sender < 0) _sender = -1;
+    int prev = -1;
+    for (int i = *head; i >= 0; prev = i, i = subscriptions[i].next) {
+        Subscription &sub = subscriptions[i];
+        if ((sub.handler == _handler) && (sub.context == _context) && (sub.sender == _sender)) {
+            // Unlink only, the entry stays in place so other indexes remain valid
+            if (prev < 0) *head = sub.next;
+            else subscriptions[prev].next = sub.next;
+            return true;
+        }
+    }
+    return false;
+}
+int GMLAN_Dispatcher::dispatch(const CANMessage &msg) {
+    CANHeader hdr;
+    hdr.decode(msg.id);
+    
+    int called = 0;
+    if (msg.format == CANExtended) {
+        int page = directory[hdr.arbitration() >> PAGE_BITS];
+        if (page != 0) {
+            int sender = hdr.sender();
+            for (int i = pages[((page - 1) * PAGE_SIZE) + (hdr.arbitration() & (PAGE_SIZE - 1))]; i >= 0; i = subscriptions[i].next) {
+                const Subscription &sub = subscriptions[i];
+                if ((sub.sender < 0) || (sub.sender == sender)) {
+                    sub.handler(hdr, msg, sub.context);
+                    called++;
+                }
+            }
+        }
+    }
+    if ((called == 0) && (fallback != NULL)) fallback(hdr, msg, fallback_context);
+    return called;
+}
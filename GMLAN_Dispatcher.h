@@ -0,0 +1,66 @@
+/*
+GMLAN_Dispatcher.h - Arbitration ID dispatch for GMLAN Library
+
+Routes incoming 29-bit frames to callbacks registered against an arbitration ID,
+or an arbitration ID from one particular sender, in place of hand written if/else
+chains over the GMLAN_ARBID_* values.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_DISPATCHER_H
+#define GMLAN_DISPATCHER_H
+
+// Callback signature, context is handed back untouched
+typedef void (*GMLAN_Handler)(const CANHeader &hdr, const CANMessage &msg, void *context);
+
+class GMLAN_Dispatcher {
+    /*
+    Lookup is a two level table indexed by the 13-bit arbitration ID. The top 8 bits
+    select a page and the low 5 bits a slot within it, each slot holding the head of
+    the handlers for that ID. Pages are only created for ranges that have handlers
+    (the IDs in GMLAN_29bit.h fall in a handful of them), so routing a frame costs two
+    table loads however many IDs are subscribed.
+    
+    Handlers are registered up front and dispatch() never allocates, so it can sit
+    directly in the receive loop.
+    */
+    private:
+        struct Subscription {
+            GMLAN_Handler handler;
+            void *context;
+            int sender;
+            int next;
+        };
+        
+        static const int PAGE_BITS = 5;
+        static const int PAGE_SIZE = 1 << PAGE_BITS;
+        static const int PAGE_COUNT = 0x2000 >> PAGE_BITS;
+        
+        uint16_t directory [PAGE_COUNT];
+        vector<int16_t> pages;
+        vector<Subscription> subscriptions;
+        GMLAN_Handler fallback;
+        void *fallback_context;
+        
+        int16_t *slot(int _arbitration, bool _create);
+    
+    public:
+        // Main function
+        GMLAN_Dispatcher();
+        
+        // Register a handler for an arbitration ID, pass a sender to only receive frames from that ECU
+        bool subscribe(int _arbitration, GMLAN_Handler _handler, void *_context = NULL, int _sender = -1);
+        // Remove a handler previously registered with the same arguments
+        bool unsubscribe(int _arbitration, GMLAN_Handler _handler, void *_context = NULL, int _sender = -1);
+        // Handler for 11-bit frames and 29-bit frames nobody subscribed to
+        void setFallback(GMLAN_Handler _handler, void *_context = NULL) { fallback = _handler; fallback_context = _context; }
+        
+        // Decode the header and call every matching handler, returns the number called
+        int dispatch(const CANMessage &msg);
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+GMLAN_Download.cpp - Pipelined module programming for GMLAN Library
+
+Streams an image into a module with $34 / $36, preparing each block while the
+previous one is still in flight.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Download.h"
+
+GMLAN_Download::GMLAN_Download(int _id, int _block_size, int _address_bytes)
+    : request(_id, vector<char>()) {
+    address_bytes = (_address_bytes < 2) ? 2 : ((_address_bytes > 4) ? 4 : _address_bytes);
+    // SID + sub-function + address ahead of the data, ISO-TP lengths stop at 4095
+    int header = 2 + address_bytes;
+    block_data = (_block_size > (0xFFF - header)) ? (0xFFF - header) : _block_size;
+    if (block_data < 1) block_data = 1;
+    for (int b = 0; b < 2; b++) {
+        buffers[b].resize(header + block_data);
+        buffer_length[b] = 0;
+    }
+    active = 0;
+    next_ready = false;
+    source_memory = NULL;
+    source_file = NULL;
+    source_length = source_offset = address = 0;
+    bytes_acknowledged = start_us = last_us = 0;
+    timing = false;
+    state = GMLAN_DOWNLOAD_IDLE;
+}
+bool GMLAN_Download::begin(const char *_image, uint32_t _length, uint32_t _address) {
+    source_memory = _image;
+    source_file = NULL;
+    source_length = _length;
+    address = _address;
+    source_offset = bytes_acknowledged = 0;
+    start_us = last_us = 0;
+    timing = false;
+    next_ready = false;
+    
+    // $34 00 followed by the total size in the same width as the addresses
+    char *req = &buffers[0][0];
+    int length = 0;
+    req[length++] = GMLAN_SID_DL_REQ;
+    req[length++] = 0x00;
+    for (int i = address_bytes - 1; i >= 0; i--) req[length++] = (_length >> (i * 8)) & 0xFF;
+    buffer_length[0] = length;
+    sendBlock(0);
+    state = GMLAN_DOWNLOAD_REQUESTING;
+    return true;
+}
+bool GMLAN_Download::begin(FILE *_file, uint32_t _length, uint32_t _address) {
+    if (_file == NULL) return false;
+    begin((const char *)NULL, _length, _address);
+    source_file = _file;
+    return true;
+}
+bool GMLAN_Download::prepareBlock(int _buffer) {
+    uint32_t remaining = source_length - source_offset;
+    int chunk = (remaining > (uint32_t)block_data) ? block_data : remaining;
+    if (chunk <= 0) return false;
+    
+    char *block = &buffers[_buffer][0];
+    int length = 0;
+    uint32_t target = address + source_offset;
+    block[length++] = GMLAN_SID_DATA_TRANS;
+    block[length++] = 0x00;
+    for (int i = address_bytes - 1; i >= 0; i--) block[length++] = (target >> (i * 8)) & 0xFF;
+    if (source_file != NULL) {
+        if (fread(block + length, 1, chunk, source_file) != (size_t)chunk) return false;
+    } else memcpy(block + length, source_memory + source_offset, chunk);
+    
+    buffer_length[_buffer] = length + chunk;
+    source_offset += chunk;
+    return true;
+}
+void GMLAN_Download::sendBlock(int _buffer) {
+    active = _buffer;
+    request.reset(&buffers[_buffer][0], buffer_length[_buffer]);
+    request.start();
+}
+bool GMLAN_Download::positive(int _sid) {
+    return (request.getState() == GMLAN_STATE_COMPLETED) && (request.getResponseLength() > 0) &&
+           ((request.getResponseData()[0] & 0xFF) == ((_sid + 0x40) & 0xFF));
+}
+int GMLAN_Download::update(uint32_t now_us) {
+    // Throughput is timed from the first update after begin()
+    if (!timing) {
+        start_us = now_us;
+        timing = true;
+    }
+    last_us = now_us;
+    if ((state != GMLAN_DOWNLOAD_REQUESTING) && (state != GMLAN_DOWNLOAD_TRANSFERRING)) return state;
+    int req_state = request.getState();
+    if (req_state > GMLAN_STATE_COMPLETED) {
+        fail();
+        return state;
+    }
+    
+    // While the module is busy with the current request (including any $78 pending
+    // period) read the next block into the buffer that isn't on the bus
+    bool more = source_offset < source_length;
+    bool waiting = (req_state == GMLAN_STATE_AWAITING_FC) || (req_state == GMLAN_STATE_AWAITING_REPLY);
+    if (!next_ready && more && waiting) {
+        if (!prepareBlock(active ^ 1)) {
+            fail();
+            return state;
+        }
+        next_ready = true;
+    }
+    if (req_state != GMLAN_STATE_COMPLETED) return state;
+    
+    if (state == GMLAN_DOWNLOAD_REQUESTING) {
+        if (!positive(GMLAN_SID_DL_REQ)) {
+            fail();
+            return state;
+        }
+        state = GMLAN_DOWNLOAD_TRANSFERRING;
+    } else {
+        if (!positive(GMLAN_SID_DATA_TRANS)) {
+            fail();
+            return state;
+        }
+        bytes_acknowledged += buffer_length[active] - (2 + address_bytes);
+    }
+    
+    // Module never made us wait, read the block now
+    if (!next_ready && more) {
+        if (!prepareBlock(active ^ 1)) {
+            fail();
+            return state;
+        }
+        next_ready = true;
+    }
+    if (next_ready) {
+        next_ready = false;
+        sendBlock(active ^ 1);
+    } else state = GMLAN_DOWNLOAD_COMPLETED;
+    return state;
+}
+double GMLAN_Download::getThroughput(void) {
+    uint32_t elapsed = last_us - start_us;
+    if (elapsed == 0) return 0;
+    return (double)bytes_acknowledged * 1000000.0 / elapsed;
+}
@@ -0,0 +1,87 @@
+/*
+GMLAN_Download.h - Pipelined module programming for GMLAN Library
+
+Streams an image into a module with GMLAN_SID_DL_REQ ($34) followed by as many
+GMLAN_SID_DATA_TRANS ($36) blocks as it takes, reusing a single request object.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#ifndef GMLAN_DOWNLOAD_H
+#define GMLAN_DOWNLOAD_H
+
+// States of download
+#define GMLAN_DOWNLOAD_IDLE         0x0
+#define GMLAN_DOWNLOAD_REQUESTING   0x1
+#define GMLAN_DOWNLOAD_TRANSFERRING 0x2
+#define GMLAN_DOWNLOAD_COMPLETED    0x3
+#define GMLAN_DOWNLOAD_ERROR        0x4
+
+class GMLAN_Download {
+    /*
+    Two block buffers are allocated once up front. While one block is on the bus
+    or the module is still answering $78 "response pending" for it, the next block
+    is read from the file or memory region into the other buffer, so the next
+    transfer can start the moment the module accepts the previous one. Each block
+    is sent straight from its buffer through GMLAN_11Bit_Request::reset(), the
+    request itself never copies it.
+    
+    The download is driven like any single request: send the frames getRequest()
+    produces, feed it received frames and call update() in the same loop. Each
+    request is started automatically.
+    
+        GMLAN_Download dl(GMLAN_TO_EBCM);
+        dl.begin(image, image_length, 0x00010000);
+        while (dl.update(us_ticker_read()) < GMLAN_DOWNLOAD_COMPLETED) {
+            GMLAN_11Bit_Request &req = dl.getRequest();
+            if (req.frameDue(us_ticker_read())) can.write(req.getNextFrame(us_ticker_read()));
+            if (req.getState() == GMLAN_STATE_SEND_FC) can.write(req.getFlowControl());
+            if (can.read(msg)) req.processFrame(msg);
+        }
+    */
+    private:
+        GMLAN_11Bit_Request request;
+        int address_bytes, block_data;
+        vector<char> buffers [2];
+        int buffer_length [2];
+        int active;
+        bool next_ready;
+        
+        const char *source_memory;
+        FILE *source_file;
+        uint32_t source_length, source_offset, address;
+        uint32_t bytes_acknowledged, start_us, last_us;
+        bool timing;
+        int state;
+        
+        bool prepareBlock(int _buffer);
+        void sendBlock(int _buffer);
+        void fail(void) { state = GMLAN_DOWNLOAD_ERROR; }
+        bool positive(int _sid);
+    
+    public:
+        // Main function, _block_size is the data carried per $36 (capped so the request stays within 4095 bytes)
+        GMLAN_Download(int _id, int _block_size = 4088, int _address_bytes = 4);
+        
+        // Start downloading _length bytes to the module's _address from memory or an open file
+        bool begin(const char *_image, uint32_t _length, uint32_t _address);
+        bool begin(FILE *_file, uint32_t _length, uint32_t _address);
+        
+        // Advance the download, returns one of the GMLAN_DOWNLOAD_* states
+        int update(uint32_t now_us);
+        
+        // The request currently in flight
+        GMLAN_11Bit_Request &getRequest(void) { return request; }
+        int getState(void) { return state; }
+        
+        // Progress, and bytes per second accepted by the module since begin()
+        uint32_t getBytesSent(void) { return bytes_acknowledged; }
+        uint32_t getLength(void) { return source_length; }
+        double getThroughput(void);
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+GMLAN_FilterPlanner.cpp - CAN controller acceptance filter planning for GMLAN Library
+
+Works out mask / filter pairs for the CAN controller from the set of frames the
+application actually listens to.
+*/
+
+#include "mbed.h"
+#include "GMLAN_FilterPlanner.h"
+
+// Index 0 holds 11-bit patterns, index 1 holds 29-bit patterns
+static const int FORMAT_BITS [2] = { 11, 29 };
+
+void GMLAN_FilterPlanner::add29bit(int _arbitration, int _sender) {
+    Pattern p;
+    p.mask = 0x1FFF << 13;
+    p.value = (_arbitration & 0x1FFF) << 13;
+    if (_sender >= 0) {
+        p.mask |= 0x1FFF;
+        p.value |= _sender & 0x1FFF;
+    }
+    subscriptions[1].push_back(p);
+}
+void GMLAN_FilterPlanner::add11bit(int _id) {
+    Pattern p = { (uint32_t)(_id & 0x7FF), 0x7FF };
+    subscriptions[0].push_back(p);
+}
+void GMLAN_FilterPlanner::addRequest(GMLAN_11Bit_Request &_request) {
+    int ecu = _request.getID() & 0xFF;
+    add11bit(0x600 | ecu);
+    add11bit(0x500 | ecu);
+}
+void GMLAN_FilterPlanner::addTraffic(uint32_t _id, CANFormat _format, double _frames_per_second) {
+    Traffic t = { _id & ((_format == CANExtended) ? 0x1FFFFFFF : 0x7FF), _frames_per_second, false };
+    traffic[(_format == CANExtended) ? 1 : 0].push_back(t);
+}
+void GMLAN_FilterPlanner::clear(void) {
+    for (int f = 0; f < 2; f++) {
+        subscriptions[f].clear();
+        planned[f].clear();
+        traffic[f].clear();
+    }
+}
+bool GMLAN_FilterPlanner::covers(const Pattern &a, const Pattern &b) {
+    // a accepts everything b does: a cares about no bit b ignores, and agrees on the rest
+    return ((a.mask & ~b.mask) == 0) && (((a.value ^ b.value) & a.mask) == 0);
+}
+GMLAN_FilterPlanner::Pattern GMLAN_FilterPlanner::merge(const Pattern &a, const Pattern &b) {
+    // Keep only the bits both care about and agree on
+    Pattern p;
+    p.mask = a.mask & b.mask & ~(a.value ^ b.value);
+    p.value = a.value & p.mask;
+    return p;
+}
+double GMLAN_FilterPlanner::space(const Pattern &p, int _bits) {
+    int free_bits = _bits;
+    for (uint32_t m = p.mask; m != 0; m &= m - 1) free_bits--;
+    return (double)(1ULL << free_bits);
+}
+double GMLAN_FilterPlanner::cost(const Pattern &p, int _format) {
+    if (traffic[_format].empty()) return space(p, FORMAT_BITS[_format]);
+    double unwanted = 0;
+    for (size_t i = 0; i < traffic[_format].size(); i++) {
+        const Traffic &t = traffic[_format][i];
+        if (!t.wanted && (((t.id ^ p.value) & p.mask) == 0)) unwanted += t.rate;
+    }
+    return unwanted;
+}
+void GMLAN_FilterPlanner::planFormat(int _format, int _max_filters) {
+    vector<Pattern> &out = planned[_format];
+    out.clear();
+    const vector<Pattern> &subs = subscriptions[_format];
+    if (subs.empty()) return;
+    
+    // Mark which observed frames are actually wanted
+    for (size_t i = 0; i < traffic[_format].size(); i++) {
+        Traffic &t = traffic[_format][i];
+        t.wanted = false;
+        for (size_t s = 0; s < subs.size() && !t.wanted; s++) t.wanted = ((t.id ^ subs[s].value) & subs[s].mask) == 0;
+    }
+    
+    if (_max_filters <= 0) {
+        // No banks to plan into, one accept-all filter rather than silently receiving nothing
+        Pattern all = { 0, 0 };
+        out.push_back(all);
+        return;
+    }
+    
+    // Drop patterns another one already covers
+    for (size_t i = 0; i < subs.size(); i++) {
+        bool redundant = false;
+        for (size_t j = 0; j < out.size() && !redundant; j++) redundant = covers(out[j], subs[i]);
+        if (redundant) continue;
+        for (size_t j = 0; j < out.size();) {
+            if (covers(subs[i], out[j])) out.erase(out.begin() + j);
+            else j++;
+        }
+        out.push_back(subs[i]);
+    }
+    
+    // Merge the cheapest pair until the plan fits
+    vector<double> costs(out.size());
+    for (size_t i = 0; i < out.size(); i++) costs[i] = cost(out[i], _format);
+    while ((int)out.size() > _max_filters) {
+        size_t best_a = 0, best_b = 1;
+        double best_cost = 0, best_space = 0;
+        bool found = false;
+        for (size_t a = 0; a < out.size(); a++) {
+            for (size_t b = a + 1; b < out.size(); b++) {
+                Pattern m = merge(out[a], out[b]);
+                double growth = cost(m, _format) - costs[a] - costs[b];
+                double size = space(m, FORMAT_BITS[_format]);
+                if (!found || (growth < best_cost) || ((growth == best_cost) && (size < best_space))) {
+                    found = true;
+                    best_a = a;
+                    best_b = b;
+                    best_cost = growth;
+                    best_space = size;
+                }
+            }
+        }
+        Pattern m = merge(out[best_a], out[best_b]);
+        out.erase(out.begin() + best_b);
+        costs.erase(costs.begin() + best_b);
+        out[best_a] = m;
+        costs[best_a] = cost(m, _format);
+        
+        // The wider filter may now swallow others
+        for (size_t j = 0; j < out.size();) {
+            if ((j != best_a) && covers(out[best_a], out[j])) {
+                out.erase(out.begin() + j);
+                costs.erase(costs.begin() + j);
+                if (j < best_a) best_a--;
+            } else j++;
+        }
+    }
+}
+void GMLAN_FilterPlanner::plan(int _max_11bit, int _max_29bit) {
+    planFormat(0, _max_11bit);
+    planFormat(1, _max_29bit);
+}
+GMLAN_Filter GMLAN_FilterPlanner::getFilter(int _index) {
+    GMLAN_Filter f;
+    int format = (_index < (int)planned[0].size()) ? 0 : 1;
+    const Pattern &p = planned[format][(format == 0) ? _index : (_index - planned[0].size())];
+    f.id = p.value;
+    f.mask = p.mask;
+    f.format = (format == 0) ? CANStandard : CANExtended;
+    return f;
+}
+double GMLAN_FilterPlanner::falseAcceptRate(void) {
+    double unwanted = 0, accepted = 0;
+    for (int format = 0; format < 2; format++) {
+        if (!traffic[format].empty()) {
+            for (size_t i = 0; i < traffic[format].size(); i++) {
+                const Traffic &t = traffic[format][i];
+                if (t.wanted) continue;
+                unwanted += t.rate;
+                for (size_t f = 0; f < planned[format].size(); f++) {
+                    if (((t.id ^ planned[format][f].value) & planned[format][f].mask) == 0) {
+                        accepted += t.rate;
+                        break;
+                    }
+                }
+            }
+        } else {
+            // Without a profile assume every identifier is equally likely
+            double total = space(Pattern(), FORMAT_BITS[format]);
+            double wanted = 0, passed = 0;
+            for (size_t s = 0; s < subscriptions[format].size(); s++) wanted += space(subscriptions[format][s], FORMAT_BITS[format]);
+            for (size_t f = 0; f < planned[format].size(); f++) passed += space(planned[format][f], FORMAT_BITS[format]);
+            if (wanted > total) wanted = total;
+            if (passed > total) passed = total;
+            unwanted += total - wanted;
+            if (passed > wanted) accepted += passed - wanted;
+        }
+    }
+    return (unwanted > 0) ? (accepted / unwanted) : 0.0;
+}
@@ -0,0 +1,99 @@
+/*
+GMLAN_FilterPlanner.h - CAN controller acceptance filter planning for GMLAN Library
+
+Works out mask / filter pairs for the CAN controller from the set of frames the
+application actually listens to, so unwanted traffic is dropped in hardware rather
+than interrupting the MCU.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_FILTERPLANNER_H
+#define GMLAN_FILTERPLANNER_H
+
+struct GMLAN_Filter {
+    uint32_t id, mask;
+    CANFormat format;
+};
+
+class GMLAN_FilterPlanner {
+    /*
+    Each subscription becomes a pattern over the raw identifier. 29-bit patterns
+    follow the CANHeader layout: the arbitration ID bits always matter, the sender
+    bits only when a sender is given, and the priority bits never do since an ECU
+    may send the same arbid at different priorities.
+    
+    plan() starts from one filter per pattern and greedily merges the pair that
+    lets the least unwanted traffic through, until the set fits the controller's
+    filter banks. With a traffic profile (addTraffic(), e.g. counted from a trace)
+    "least unwanted traffic" is measured against it, otherwise against the raw
+    size of the identifier space each filter opens up.
+    
+    Example:
+    
+        GMLAN_FilterPlanner planner;
+        planner.add29bit(GMLAN_ARBID_VEHICLE_SPEED_INFORMATION);
+        planner.add29bit(GMLAN_ARBID_STEERING_WHEEL_CONTROL_SWITCHES, 0x60);
+        planner.addRequest(request);
+        planner.plan(4, 8);
+        planner.apply(can);
+    */
+    private:
+        struct Pattern {
+            uint32_t value, mask;
+        };
+        struct Traffic {
+            uint32_t id;
+            double rate;
+            bool wanted;
+        };
+        
+        vector<Pattern> subscriptions [2];
+        vector<Pattern> planned [2];
+        vector<Traffic> traffic [2];
+        
+        static bool covers(const Pattern &a, const Pattern &b);
+        static Pattern merge(const Pattern &a, const Pattern &b);
+        static double space(const Pattern &p, int _bits);
+        double cost(const Pattern &p, int _format);
+        void planFormat(int _format, int _max_filters);
+    
+    public:
+        // 29-bit frames for an arbitration ID, from any sender or just one
+        void add29bit(int _arbitration, int _sender = -1);
+        // 11-bit frames with an exact identifier
+        void add11bit(int _id);
+        // Responses to an 11-bit request (USDT $6xx and UUDT $5xx for the same ECU)
+        void addRequest(GMLAN_11Bit_Request &_request);
+        // Observed traffic, frames per second per raw identifier, to weight the plan
+        void addTraffic(uint32_t _id, CANFormat _format, double _frames_per_second);
+        void clear(void);
+        
+        // Compute filters for each format within the given number of banks. A format with
+        // subscriptions but 0 banks gets a single accept-all filter
+        void plan(int _max_11bit, int _max_29bit);
+        
+        // Planned filters, in the order they should be loaded
+        int count(void) { return planned[0].size() + planned[1].size(); }
+        GMLAN_Filter getFilter(int _index);
+        
+        // Share of unwanted traffic that still passes the filters, 0.0 - 1.0. Weighted by the
+        // traffic profile when there is one, otherwise by identifier space (an upper bound)
+        double falseAcceptRate(void);
+        
+        // Load the plan into a controller with mbed's CAN::filter(id, mask, format, handle)
+        template <class Controller>
+        int apply(Controller &can) {
+            int loaded = 0;
+            for (int i = 0; i < count(); i++) {
+                GMLAN_Filter f = getFilter(i);
+                if (can.filter(f.id, f.mask, f.format, i) != 0) loaded++;
+            }
+            return loaded;
+        }
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+GMLAN_Instrumentation.cpp - Request latency instrumentation for GMLAN Library
+
+Timeline bookkeeping, histograms and the per-ECU latency table. Empty unless
+built with GMLAN_INSTRUMENTATION.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_Instrumentation.h"
+
+#ifdef GMLAN_INSTRUMENTATION
+
+#include <string.h>
+
+GMLAN_LatencyStats gmlan_latency;
+
+void GMLAN_RequestTimeline::clear(void) {
+    transitions = 0;
+    start_us = first_frame_us = fc_since_us = 0;
+    fc_wait_us = total_us = 0;
+    pending_responses = 0;
+    started = received = false;
+}
+void GMLAN_RequestTimeline::transition(int _id, int _from, int _to) {
+    uint32_t now = us_ticker_read();
+    int slot = transitions % GMLAN_TIMELINE_LENGTH;
+    states[slot] = _to;
+    times_us[slot] = now;
+    transitions++;
+    
+    if (!started && (_from == GMLAN_STATE_READY_TO_SEND)) {
+        started = true;
+        start_us = now;
+    }
+    if (_from == GMLAN_STATE_AWAITING_FC) fc_wait_us += now - fc_since_us;
+    if (_to == GMLAN_STATE_AWAITING_FC) fc_since_us = now;
+    if (started && (_to >= GMLAN_STATE_COMPLETED)) {
+        total_us = now - start_us;
+        gmlan_latency.report(_id, *this, _to == GMLAN_STATE_COMPLETED);
+    }
+}
+void GMLAN_RequestTimeline::frameReceived(void) {
+    if (received || !started) return;
+    received = true;
+    first_frame_us = us_ticker_read() - start_us;
+}
+
+void GMLAN_Histogram::clear(void) {
+    memset(buckets, 0, sizeof(buckets));
+    samples = maximum = 0;
+    minimum = 0xFFFFFFFF;
+    sum = 0;
+}
+void GMLAN_Histogram::add(uint32_t _us) {
+    int n = 0;
+    while ((_us >> n) && (n < GMLAN_HISTOGRAM_BUCKETS - 1)) n++;
+    buckets[n]++;
+    samples++;
+    sum += _us;
+    if (_us < minimum) minimum = _us;
+    if (_us > maximum) maximum = _us;
+}
+uint32_t GMLAN_Histogram::percentile(int _percent) const {
+    if (samples == 0) return 0;
+    uint64_t target = ((uint64_t)samples * _percent + 99) / 100;
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int n = 0; n < GMLAN_HISTOGRAM_BUCKETS; n++) {
+        seen += buckets[n];
+        if (seen >= target) {
+            uint32_t upper = ((uint32_t)1 << n) - 1;
+            return (upper < maximum) ? upper : maximum;
+        }
+    }
+    return maximum;
+}
+
+GMLAN_LatencyStats::GMLAN_LatencyStats() {
+    memset(ecus, 0, sizeof(ecus));
+}
+GMLAN_LatencyStats::~GMLAN_LatencyStats() {
+    for (int i = 0; i < 256; i++) delete ecus[i];
+}
+void GMLAN_LatencyStats::report(int _id, const GMLAN_RequestTimeline &_timeline, bool _completed) {
+    GMLAN_ECULatency *&ecu = ecus[_id & 0xFF];
+    if (ecu == NULL) {
+        ecu = new GMLAN_ECULatency();
+        ecu->completed = ecu->errors = ecu->pending_responses = 0;
+    }
+    if (_timeline.received) ecu->first_frame.add(_timeline.first_frame_us);
+    if (_timeline.fc_wait_us > 0) ecu->fc_wait.add(_timeline.fc_wait_us);
+    ecu->total.add(_timeline.total_us);
+    ecu->pending_responses += _timeline.pending_responses;
+    if (_completed) ecu->completed++;
+    else ecu->errors++;
+}
+void GMLAN_LatencyStats::clear(void) {
+    for (int i = 0; i < 256; i++) {
+        delete ecus[i];
+        ecus[i] = NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+GMLAN_Instrumentation.h - Request latency instrumentation for GMLAN Library
+
+Build with GMLAN_INSTRUMENTATION defined to have every GMLAN_11Bit_Request keep
+a timeline of its state transitions, count the ECU's "still processing" (0x78)
+responses and report first frame time, flow control wait and total round trip
+into per-ECU histograms. Without the define none of this is compiled in and the
+request classes are exactly as they would otherwise be.
+*/
+
+#include "mbed.h"
+#include <stdint.h>
+
+#ifndef GMLAN_INSTRUMENTATION_H
+#define GMLAN_INSTRUMENTATION_H
+
+#ifdef GMLAN_INSTRUMENTATION
+
+// Transitions kept per request, older ones are overwritten
+#define GMLAN_TIMELINE_LENGTH 16
+// Power of two buckets, bucket n holds [2^(n-1), 2^n) microseconds
+#define GMLAN_HISTOGRAM_BUCKETS 32
+
+struct GMLAN_RequestTimeline {
+    /*
+    Times are us_ticker_read() values. The log holds the latest transitions as a
+    ring, entry (transitions - 1) % GMLAN_TIMELINE_LENGTH being the newest.
+    */
+    uint8_t states [GMLAN_TIMELINE_LENGTH];
+    uint32_t times_us [GMLAN_TIMELINE_LENGTH];
+    uint32_t transitions;
+    uint32_t start_us, first_frame_us, fc_since_us;
+    uint32_t fc_wait_us, total_us;
+    uint16_t pending_responses;
+    bool started, received;
+    
+    // Forget everything, called when a request is (re)armed
+    void clear(void);
+    // Called by the request on each state change and on each frame it accepts
+    void transition(int _id, int _from, int _to);
+    void frameReceived(void);
+    void pendingResponse(void) { pending_responses++; }
+};
+
+class GMLAN_Histogram {
+    /*
+    Log2 bucketed latency histogram, fixed size so recording never allocates
+    */
+    private:
+        uint32_t buckets [GMLAN_HISTOGRAM_BUCKETS];
+        uint32_t samples, minimum, maximum;
+        uint64_t sum;
+    
+    public:
+        // Main function
+        GMLAN_Histogram() { clear(); }
+        
+        void add(uint32_t _us);
+        void clear(void);
+        
+        uint32_t count(void) const { return samples; }
+        uint32_t min(void) const { return minimum; }
+        uint32_t max(void) const { return maximum; }
+        uint32_t mean(void) const { return samples ? (uint32_t)(sum / samples) : 0; }
+        uint32_t bucket(int _n) const { return ((_n >= 0) && (_n < GMLAN_HISTOGRAM_BUCKETS)) ? buckets[_n] : 0; }
+        // Upper bound of the bucket holding the _percent'th percentile, capped at max()
+        uint32_t percentile(int _percent) const;
+};
+
+struct GMLAN_ECULatency {
+    GMLAN_Histogram first_frame, fc_wait, total;
+    uint32_t completed, errors, pending_responses;
+};
+
+class GMLAN_LatencyStats {
+    /*
+    Per-ECU figures, keyed on the low byte of the request ID as the session
+    manager does (0x241 and its 0x641 / 0x541 responses are all ECU 0x41).
+    An ECU's histograms are allocated the first time it reports. Not thread
+    safe, requests are expected to finish in one context.
+    */
+    private:
+        GMLAN_ECULatency *ecus [256];
+    
+    public:
+        // Main function
+        GMLAN_LatencyStats();
+        ~GMLAN_LatencyStats();
+        
+        // Fold a finished request's timeline in
+        void report(int _id, const GMLAN_RequestTimeline &_timeline, bool _completed);
+        // NULL until the ECU has reported
+        const GMLAN_ECULatency *getECU(int _id) const { return ecus[_id & 0xFF]; }
+        void clear(void);
+};
+
+// Every request reports here
+extern GMLAN_LatencyStats gmlan_latency;
+
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+/*
+GMLAN_MultiBus.cpp - Multi-bus ingestion for GMLAN Library
+
+Per-bus receive workers and the timestamp ordered merge.
+*/
+
+#include "mbed.h"
+#include "GMLAN_MultiBus.h"
+
+GMLAN_MultiBus::GMLAN_MultiBus() : running(false) {
+    for (int i = 0; i < GMLAN_MULTIBUS_MAX; i++) buses[i] = NULL;
+    bus_count = 0;
+    max_skew_us = 10000;
+    flushing = false;
+}
+GMLAN_MultiBus::~GMLAN_MultiBus() {
+    stop();
+    for (int i = 0; i < bus_count; i++) delete buses[i];
+}
+int GMLAN_MultiBus::addBus(GMLAN_Transport &_transport, uint32_t _baud) {
+    if ((bus_count >= GMLAN_MULTIBUS_MAX) || running.load()) return -1;
+    Bus *bus = new Bus();
+    bus->transport = &_transport;
+    bus->baud = _baud;
+    bus->watermark.store(0);
+    bus->frames.store(0);
+    bus->ahead_pos = bus->ahead_count = 0;
+    buses[bus_count] = bus;
+    return bus_count++;
+}
+int GMLAN_MultiBus::ingest(int _bus) {
+    Bus &bus = *buses[_bus];
+    CANMessage frames [GMLAN_MULTIBUS_BATCH];
+    uint64_t timestamps [GMLAN_MULTIBUS_BATCH];
+    
+    // Leave frames in the transport rather than read more than the ring can take
+    unsigned int room = bus.ring.capacity() - bus.ring.size();
+    if (room > GMLAN_MULTIBUS_BATCH) room = GMLAN_MULTIBUS_BATCH;
+    if (room == 0) return 0;
+    int count = bus.transport->read(frames, room, timestamps);
+    if (count <= 0) return 0;
+    
+    GMLAN_BusFrame frame;
+    frame.bus = _bus;
+    for (int i = 0; i < count; i++) {
+        frame.timestamp_us = timestamps[i];
+        frame.msg = frames[i];
+        frame.header = CANHeader();
+        frame.header.decode(frames[i].id);
+        bus.ring.push(frame);
+    }
+    bus.frames.store(bus.frames.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    // Published after the frames, so the merge never sees a watermark ahead of the ring
+    bus.watermark.store(timestamps[count - 1], std::memory_order_release);
+    return count;
+}
+void GMLAN_MultiBus::work(int _bus) {
+    GMLAN_Transport *transport = buses[_bus]->transport;
+    while (running.load(std::memory_order_relaxed)) {
+        if (ingest(_bus) > 0) continue;
+        // Transports that can block do so here, the rest get the core handed back
+        transport->wait(1);
+#if defined(__linux__)
+        std::this_thread::yield();
+#endif
+    }
+}
+bool GMLAN_MultiBus::start(void) {
+#if defined(__linux__)
+    if (running.load()) return true;
+    flushing = false;
+    running.store(true);
+    for (int i = 0; i < bus_count; i++) buses[i]->worker = std::thread(&GMLAN_MultiBus::work, this, i);
+    return true;
+#else
+    return false;
+#endif
+}
+void GMLAN_MultiBus::stop(void) {
+#if defined(__linux__)
+    if (!running.load()) return;
+    running.store(false);
+    for (int i = 0; i < bus_count; i++) {
+        if (buses[i]->worker.joinable()) buses[i]->worker.join();
+    }
+#endif
+}
+bool GMLAN_MultiBus::next(GMLAN_BusFrame &frame) {
+    return next(&frame, 1) == 1;
+}
+int GMLAN_MultiBus::next(GMLAN_BusFrame *frames, int _max) {
+    // Watermarks first: whatever they cover is already in the rings
+    uint64_t watermarks [GMLAN_MULTIBUS_MAX];
+    uint64_t latest = 0;
+    for (int i = 0; i < bus_count; i++) {
+        watermarks[i] = buses[i]->watermark.load(std::memory_order_acquire);
+        if (watermarks[i] > latest) latest = watermarks[i];
+    }
+    
+    int count = 0;
+    while (count < _max) {
+        int oldest = -1;
+        for (int i = 0; i < bus_count; i++) {
+            Bus &bus = *buses[i];
+            if (bus.ahead_pos == bus.ahead_count) {
+                bus.ahead_count = bus.ring.pop(bus.ahead, GMLAN_MULTIBUS_BATCH);
+                bus.ahead_pos = 0;
+                if (bus.ahead_count == 0) continue;
+            }
+            if ((oldest < 0) || (bus.ahead[bus.ahead_pos].timestamp_us < buses[oldest]->ahead[buses[oldest]->ahead_pos].timestamp_us)) oldest = i;
+        }
+        if (oldest < 0) break;
+        
+        Bus &source = *buses[oldest];
+        uint64_t candidate = source.ahead[source.ahead_pos].timestamp_us;
+        if (!flushing) {
+            bool hold = false;
+            for (int i = 0; i < bus_count; i++) {
+                // An empty bus that has already read past the candidate can't produce anything older
+                if ((buses[i]->ahead_pos < buses[i]->ahead_count) || (watermarks[i] >= candidate)) continue;
+                if (candidate + max_skew_us > latest) {
+                    hold = true;
+                    break;
+                }
+            }
+            if (hold) break;
+        }
+        frames[count++] = source.ahead[source.ahead_pos++];
+    }
+    return count;
+}
@@ -0,0 +1,130 @@
+/*
+GMLAN_MultiBus.h - Multi-bus ingestion for GMLAN Library
+
+Loggers often sit on single-wire LS, mid-speed and high-speed GMLAN at once.
+GMLAN_MultiBus takes frames from one GMLAN_Transport per bus, decodes their
+headers as they arrive and merges them into one stream in timestamp order,
+each frame tagged with the bus it came from.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_Ring.h"
+#include "GMLAN_Transport.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifndef GMLAN_MULTIBUS_H
+#define GMLAN_MULTIBUS_H
+
+#if defined(__linux__)
+#include <thread>
+#endif
+
+// Buses handled at once
+#define GMLAN_MULTIBUS_MAX 4
+// Frames each bus can have waiting for the merge, a power of two
+#ifndef GMLAN_MULTIBUS_DEPTH
+#define GMLAN_MULTIBUS_DEPTH 1024
+#endif
+// Frames moved between a transport, a ring and the merge per call
+#define GMLAN_MULTIBUS_BATCH 32
+
+struct GMLAN_BusFrame {
+    uint64_t timestamp_us;
+    CANMessage msg;
+    CANHeader header;
+    uint8_t bus;
+};
+
+class GMLAN_MultiBus {
+    /*
+    Each bus has a receive worker feeding its own GMLAN_Ring, so the buses never
+    contend with each other. On Linux start() runs every worker on its own thread,
+    elsewhere call ingest() for each bus from the main loop or a receive interrupt.
+    Frames are read in batches only as large as the ring has room for, anything
+    beyond stays queued in the transport rather than being dropped here.
+    
+    next() is a k-way merge over the rings' heads. Timestamps only increase within a
+    bus, so once every bus has a frame waiting the oldest of them is safe to
+    release. A bus with nothing waiting could still deliver something older, so
+    until it does the merge holds back anything newer than its latest frame,
+    giving up after setMaxSkew() microseconds (default 10ms) of traffic on the
+    other buses, so a quiet bus can't stall the stream. Holding back can't stall
+    it either: a full ring only stops its own worker, whose frames are the newer
+    ones, as long as the skew is shorter than a full ring's worth of traffic
+    (GMLAN_MULTIBUS_DEPTH frames, over 100ms even on a saturated HS bus). Frames
+    only come out of order when a bus is read more than the skew late. flush()
+    releases everything, e.g. after stop().
+    
+    Example:
+    
+        GMLAN_SocketCAN ls, hs;
+        ls.open("can0");
+        hs.open("can1");
+        GMLAN_MultiBus buses;
+        buses.addBus(ls, GMLAN_BAUD_LS_NORMAL);
+        buses.addBus(hs, GMLAN_BAUD_HS);
+        buses.start();
+        
+        GMLAN_BusFrame frame;
+        while (1) {
+            while (buses.next(frame)) log(frame);
+            wait_us(1000);
+        }
+    
+    Only one thread may call next() / flush().
+    */
+    private:
+        struct Bus {
+            GMLAN_Transport *transport;
+            uint32_t baud;
+            GMLAN_Ring<GMLAN_BusFrame, GMLAN_MULTIBUS_DEPTH> ring;
+            std::atomic<uint64_t> watermark;
+            std::atomic<uint32_t> frames;
+            // Merge side look-ahead, taken from the ring a batch at a time
+            GMLAN_BusFrame ahead [GMLAN_MULTIBUS_BATCH];
+            unsigned int ahead_pos, ahead_count;
+#if defined(__linux__)
+            std::thread worker;
+#endif
+        };
+        
+        Bus *buses [GMLAN_MULTIBUS_MAX];
+        int bus_count;
+        uint32_t max_skew_us;
+        bool flushing;
+        std::atomic<bool> running;
+        
+        void work(int _bus);
+    
+    public:
+        // Main function
+        GMLAN_MultiBus();
+        ~GMLAN_MultiBus();
+        
+        // Register a bus, returns its tag for GMLAN_BusFrame::bus or -1 when full. The
+        // transport must outlive this object
+        int addBus(GMLAN_Transport &_transport, uint32_t _baud);
+        
+        // Run a worker thread per bus, false where threads aren't available
+        bool start(void);
+        void stop(void);
+        // Worker body, read what _bus has waiting into its ring. Returns frames taken
+        int ingest(int _bus);
+        
+        // Next frame in timestamp order, false if none can be released yet
+        bool next(GMLAN_BusFrame &frame);
+        int next(GMLAN_BusFrame *frames, int _max);
+        // Longest a quiet bus can hold the merge back, in timestamp microseconds
+        void setMaxSkew(uint32_t _us) { max_skew_us = _us; }
+        void flush(void) { flushing = true; }
+        
+        int getBusCount(void) { return bus_count; }
+        uint32_t getBaud(int _bus) { return buses[_bus]->baud; }
+        // Frames received on a bus, and frames lost because its ring was full
+        uint32_t getFrames(int _bus) { return buses[_bus]->frames.load(std::memory_order_relaxed); }
+        uint32_t getDropped(int _bus) { return buses[_bus]->ring.overflows(); }
+};
+
+#endif
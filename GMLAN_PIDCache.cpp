@@ -0,0 +1,264 @@
+/*
+GMLAN_PIDCache.cpp - Shared PID / DID reads for GMLAN Library
+
+Coalescing, packing and caching of $22 / $1A reads over a session manager.
+*/
+
+#include "mbed.h"
+#include "GMLAN_PIDCache.h"
+
+GMLAN_PIDCache::GMLAN_PIDCache(GMLAN_SessionManager &_sessions, uint32_t _default_ttl_us) : sessions(_sessions) {
+    default_ttl = _default_ttl_us;
+    hits = misses = coalesced = transactions = 0;
+    setTTL(GMLAN_SID_REQ_DID, GMLAN_DID_VIN, GMLAN_PIDCACHE_FOREVER);
+    for (int did = GMLAN_DID_PART_NUMBERS_FIRST; did <= GMLAN_DID_PART_NUMBERS_LAST; did++) setTTL(GMLAN_SID_REQ_DID, did, GMLAN_PIDCACHE_FOREVER);
+}
+int GMLAN_PIDCache::findSetting(const vector<Setting> &_settings, uint64_t _key) {
+    for (size_t i = 0; i < _settings.size(); i++) {
+        if (_settings[i].key == _key) return i;
+    }
+    return -1;
+}
+void GMLAN_PIDCache::setTTL(int _service, int _identifier, uint32_t _ttl_us) {
+    uint64_t key = makeKey(0, _service, _identifier);
+    int i = findSetting(ttls, key);
+    if (i >= 0) ttls[i].value = _ttl_us;
+    else {
+        Setting s = { key, (int)_ttl_us };
+        ttls.push_back(s);
+    }
+}
+void GMLAN_PIDCache::setPIDLength(int _pid, int _length) {
+    uint64_t key = makeKey(0, GMLAN_SID_REQ_PID, _pid);
+    int i = findSetting(lengths, key);
+    if (i >= 0) lengths[i].value = _length;
+    else {
+        Setting s = { key, _length };
+        lengths.push_back(s);
+    }
+}
+void GMLAN_PIDCache::setMaxPIDs(int _id, int _count) {
+    uint64_t key = makeKey(_id, 0, 0);
+    if (_count < 1) _count = 1;
+    int i = findSetting(max_pids, key);
+    if (i >= 0) max_pids[i].value = _count;
+    else {
+        Setting s = { key, _count };
+        max_pids.push_back(s);
+    }
+}
+uint32_t GMLAN_PIDCache::ttlFor(int _service, int _identifier) {
+    int i = findSetting(ttls, makeKey(0, _service, _identifier));
+    return (i >= 0) ? (uint32_t)ttls[i].value : default_ttl;
+}
+int GMLAN_PIDCache::pidLength(int _pid) {
+    int i = findSetting(lengths, makeKey(0, GMLAN_SID_REQ_PID, _pid));
+    return (i >= 0) ? lengths[i].value : -1;
+}
+int GMLAN_PIDCache::maxPIDs(int _id) {
+    int i = findSetting(max_pids, makeKey(_id, 0, 0));
+    return (i >= 0) ? max_pids[i].value : 1;
+}
+
+GMLAN_PIDCache::Entry *GMLAN_PIDCache::find(uint64_t _key) {
+    for (size_t i = 0; i < cache.size(); i++) {
+        if (cache[i].key == _key) return &cache[i];
+    }
+    return NULL;
+}
+const char *GMLAN_PIDCache::lookup(int _id, int _service, int _identifier, int &_length) {
+    Entry *e = find(makeKey(_id, _service, _identifier));
+    if ((e == NULL) || ((e->ttl_us != GMLAN_PIDCACHE_FOREVER) && ((uint32_t)(us_ticker_read() - e->fetched_us) >= e->ttl_us))) return NULL;
+    _length = e->data.size();
+    return e->data.empty() ? "" : &e->data[0];
+}
+void GMLAN_PIDCache::invalidate(int _id, int _service, int _identifier) {
+    uint64_t key = makeKey(_id, _service, _identifier);
+    for (size_t i = 0; i < cache.size(); i++) {
+        if (cache[i].key == key) {
+            cache.erase(cache.begin() + i);
+            return;
+        }
+    }
+}
+
+bool GMLAN_PIDCache::attach(vector<Read> &_reads, int _id, int _service, int _identifier, const Waiter &_waiter) {
+    for (size_t i = 0; i < _reads.size(); i++) {
+        Read &r = _reads[i];
+        if ((r.id == _id) && (r.service == _service) && (r.identifier == _identifier)) {
+            r.waiters.push_back(_waiter);
+            return true;
+        }
+    }
+    return false;
+}
+int GMLAN_PIDCache::read(int _id, int _service, int _identifier, GMLAN_ReadCallback _callback, void *_context) {
+    if ((_service != GMLAN_SID_REQ_PID) && (_service != GMLAN_SID_REQ_DID)) return GMLAN_PIDCACHE_FAILED;
+    _identifier &= (_service == GMLAN_SID_REQ_PID) ? 0xFFFF : 0xFF;
+    
+    int length;
+    const char *data = lookup(_id, _service, _identifier, length);
+    if (data != NULL) {
+        hits++;
+        if (_callback != NULL) _callback(_id, _service, _identifier, data, length, _context);
+        return GMLAN_PIDCACHE_HIT;
+    }
+    
+    Waiter w = { _callback, _context };
+    for (size_t t = 0; t < inflight.size(); t++) {
+        if (attach(inflight[t].reads, _id, _service, _identifier, w)) {
+            coalesced++;
+            return GMLAN_PIDCACHE_COALESCED;
+        }
+    }
+    if (attach(queued, _id, _service, _identifier, w)) {
+        coalesced++;
+        return GMLAN_PIDCACHE_COALESCED;
+    }
+    
+    misses++;
+    Read r;
+    r.id = _id;
+    r.service = _service;
+    r.identifier = _identifier;
+    r.single = false;
+    r.waiters.push_back(w);
+    queued.push_back(r);
+    return GMLAN_PIDCACHE_QUEUED;
+}
+
+void GMLAN_PIDCache::store(const Read &_read, const char *_data, int _length) {
+    uint32_t ttl = ttlFor(_read.service, _read.identifier);
+    if (ttl == 0) return;
+    uint64_t key = makeKey(_read.id, _read.service, _read.identifier);
+    Entry *e = find(key);
+    if (e == NULL) {
+        cache.push_back(Entry());
+        e = &cache.back();
+        e->key = key;
+    }
+    e->fetched_us = us_ticker_read();
+    e->ttl_us = ttl;
+    e->data.assign(_data, _data + _length);
+}
+void GMLAN_PIDCache::deliver(Read &_read, const char *_data, int _length) {
+    // Callbacks may issue new reads, don't hold on to anything they could move
+    vector<Waiter> waiters;
+    waiters.swap(_read.waiters);
+    for (size_t i = 0; i < waiters.size(); i++) {
+        if (waiters[i].callback != NULL) waiters[i].callback(_read.id, _read.service, _read.identifier, _data, _length, waiters[i].context);
+    }
+}
+void GMLAN_PIDCache::complete(Transaction &_transaction, GMLAN_11Bit_Request &_request) {
+    const char *data = _request.getResponseData();
+    int length = _request.getResponseLength();
+    vector<Read> &reads = _transaction.reads;
+    
+    if ((_request.getState() != GMLAN_STATE_COMPLETED) || (length < 1) || ((data[0] & 0xFF) != _transaction.service + 0x40)) {
+        if ((reads.size() > 1) && (length >= 1) && (data[0] == GMLAN_SID_ERROR)) {
+            // The ECU refused the packed request, ask for each PID on its own
+            for (size_t i = 0; i < reads.size(); i++) reads[i].single = true;
+            queued.insert(queued.begin(), reads.begin(), reads.end());
+            return;
+        }
+        for (size_t i = 0; i < reads.size(); i++) deliver(reads[i], NULL, -1);
+        return;
+    }
+    
+    if (_transaction.service == GMLAN_SID_REQ_DID) {
+        // 5A <DID> <data>
+        Read &r = reads[0];
+        if ((length < 2) || ((data[1] & 0xFF) != r.identifier)) deliver(r, NULL, -1);
+        else {
+            store(r, data + 2, length - 2);
+            deliver(r, data + 2, length - 2);
+        }
+        return;
+    }
+    
+    // 62 then <PID high> <PID low> <data> for each PID, the lengths tell where each record ends
+    vector<bool> answered(reads.size(), false);
+    int pos = 1;
+    while (pos + 2 <= length) {
+        int pid = ((data[pos] & 0xFF) << 8) | (data[pos + 1] & 0xFF);
+        size_t r = 0;
+        while ((r < reads.size()) && (answered[r] || (reads[r].identifier != pid))) r++;
+        if (r == reads.size()) break;
+        // A lone PID takes the rest of the response whether its length is known or not
+        int size = (reads.size() == 1) ? (length - pos - 2) : pidLength(pid);
+        if ((size < 0) || (pos + 2 + size > length)) break;
+        store(reads[r], data + pos + 2, size);
+        deliver(reads[r], data + pos + 2, size);
+        answered[r] = true;
+        pos += 2 + size;
+    }
+    for (size_t r = 0; r < reads.size(); r++) {
+        if (!answered[r]) deliver(reads[r], NULL, -1);
+    }
+}
+void GMLAN_PIDCache::dispatch(void) {
+    size_t i = 0;
+    while (i < queued.size()) {
+        int id = queued[i].id;
+        // One transaction per ECU, anything more waits and gets packed into the next one
+        // Compared on the low byte on purpose, GMLAN_SessionManager routes replies by msg.id & 0xFF
+        // so two IDs sharing it can't be in flight together
+        bool busy = false;
+        for (size_t t = 0; (t < inflight.size()) && !busy; t++) busy = ((inflight[t].id & 0xFF) == (id & 0xFF));
+        if (busy) {
+            i++;
+            continue;
+        }
+        
+        Transaction t;
+        t.id = id;
+        t.service = queued[i].service;
+        t.reads.push_back(queued[i]);
+        queued.erase(queued.begin() + i);
+        
+        const Read &first = t.reads[0];
+        bool packable = (t.service == GMLAN_SID_REQ_PID) && !first.single && (pidLength(first.identifier) >= 0);
+        int limit = packable ? maxPIDs(id) : 1;
+        for (size_t j = i; packable && (j < queued.size()) && ((int)t.reads.size() < limit); ) {
+            const Read &r = queued[j];
+            if ((r.id == id) && (r.service == GMLAN_SID_REQ_PID) && !r.single && (pidLength(r.identifier) >= 0)) {
+                t.reads.push_back(r);
+                queued.erase(queued.begin() + j);
+            } else j++;
+        }
+        
+        vector<char> request;
+        request.push_back(t.service);
+        for (size_t r = 0; r < t.reads.size(); r++) {
+            if (t.service == GMLAN_SID_REQ_PID) request.push_back(t.reads[r].identifier >> 8);
+            request.push_back(t.reads[r].identifier & 0xFF);
+        }
+        t.handle = sessions.submit(id, request);
+        if (t.handle < 0) {
+            for (size_t r = 0; r < t.reads.size(); r++) deliver(t.reads[r], NULL, -1);
+            continue;
+        }
+        transactions++;
+        inflight.push_back(t);
+    }
+}
+void GMLAN_PIDCache::update(void) {
+    for (size_t i = 0; i < inflight.size(); ) {
+        int state = sessions.getState(inflight[i].handle);
+        if (state < GMLAN_STATE_COMPLETED) {
+            i++;
+            continue;
+        }
+        // Take it out first, callbacks may read again
+        Transaction t = inflight[i];
+        inflight.erase(inflight.begin() + i);
+        complete(t, *sessions.getRequest(t.handle));
+        sessions.release(t.handle);
+    }
+    dispatch();
+}
+int GMLAN_PIDCache::pending(void) {
+    int count = queued.size();
+    for (size_t t = 0; t < inflight.size(); t++) count += inflight[t].reads.size();
+    return count;
+}
@@ -0,0 +1,141 @@
+/*
+GMLAN_PIDCache.h - Shared PID / DID reads for GMLAN Library
+
+A request layer for $22 (PID) and $1A (DID) reads on top of GMLAN_SessionManager.
+Reads of the same value from different parts of an application share one bus
+transaction, several PIDs for one ECU are packed into a single $22 request where
+the ECU allows it, and answers are kept for a configurable time so repeated reads
+are served without touching the bus. Static data such as the VIN is kept forever.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_SessionManager.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_PIDCACHE_H
+#define GMLAN_PIDCACHE_H
+
+// Identifiers that never change while the vehicle is running
+#define GMLAN_DID_VIN               0x90
+#define GMLAN_DID_PART_NUMBERS_FIRST 0xC0
+#define GMLAN_DID_PART_NUMBERS_LAST 0xCF
+
+// TTL for values that are read once and kept
+#define GMLAN_PIDCACHE_FOREVER      0xFFFFFFFF
+
+// read() outcomes
+#define GMLAN_PIDCACHE_FAILED       -1
+#define GMLAN_PIDCACHE_HIT          0
+#define GMLAN_PIDCACHE_QUEUED       1
+#define GMLAN_PIDCACHE_COALESCED    2
+
+// Value arrived, length is -1 if the read failed (negative response, timeout...)
+typedef void (*GMLAN_ReadCallback)(int id, int service, int identifier, const char *data, int length, void *context);
+
+class GMLAN_PIDCache {
+    /*
+    Reads queue up per ECU while that ECU has a transaction in flight, and go out
+    together once it finishes. $22 PIDs are only packed for ECUs given a limit with
+    setMaxPIDs() and PIDs whose data length is known from setPIDLength(), as a
+    multi-PID response can't be split up without it. If a packed request is refused
+    its PIDs are retried one at a time.
+    
+    Values are timestamped with us_ticker_read() when they arrive and served until
+    their TTL runs out: setTTL() for one identifier, the constructor's default for
+    everything else. The VIN and part number DIDs default to GMLAN_PIDCACHE_FOREVER.
+    
+    The cache drives the session manager it is given but leaves its completion
+    callback alone, finished transactions are collected by update().
+    
+    Example:
+    
+        GMLAN_SessionManager sessions;
+        GMLAN_PIDCache values(sessions);
+        values.read(GMLAN_TO_BCM, GMLAN_SID_REQ_DID, GMLAN_DID_VIN, on_vin);
+        
+        while (1) {
+            values.update();
+            while (sessions.getNextFrame(msg)) can.write(msg);
+            while (can.read(msg)) sessions.processFrame(msg);
+            sessions.expire(250000);
+        }
+    */
+    private:
+        struct Waiter {
+            GMLAN_ReadCallback callback;
+            void *context;
+        };
+        struct Read {
+            int id, service, identifier;
+            bool single;
+            vector<Waiter> waiters;
+        };
+        struct Transaction {
+            int handle, id, service;
+            vector<Read> reads;
+        };
+        struct Entry {
+            uint64_t key;
+            uint32_t fetched_us, ttl_us;
+            vector<char> data;
+        };
+        struct Setting {
+            uint64_t key;
+            int value;      // TTL in microseconds, PID length in bytes or PIDs per request
+        };
+        
+        GMLAN_SessionManager &sessions;
+        vector<Read> queued;
+        vector<Transaction> inflight;
+        vector<Entry> cache;
+        vector<Setting> ttls, lengths, max_pids;
+        uint32_t default_ttl;
+        uint32_t hits, misses, coalesced, transactions;
+        
+        // Full 11-bit ID, service and identifier, so ECUs sharing a low byte stay apart
+        static uint64_t makeKey(int _id, int _service, int _identifier) { return ((uint64_t)(_id & 0x7FF) << 24) | ((_service & 0xFF) << 16) | (_identifier & 0xFFFF); }
+        static int findSetting(const vector<Setting> &_settings, uint64_t _key);
+        Entry *find(uint64_t _key);
+        uint32_t ttlFor(int _service, int _identifier);
+        int pidLength(int _pid);
+        int maxPIDs(int _id);
+        bool attach(vector<Read> &_reads, int _id, int _service, int _identifier, const Waiter &_waiter);
+        void store(const Read &_read, const char *_data, int _length);
+        void deliver(Read &_read, const char *_data, int _length);
+        void complete(Transaction &_transaction, GMLAN_11Bit_Request &_request);
+        void dispatch(void);
+    
+    public:
+        // Main function, values without their own TTL are kept for _default_ttl_us (0 disables caching them)
+        GMLAN_PIDCache(GMLAN_SessionManager &_sessions, uint32_t _default_ttl_us = 100000);
+        
+        // Read a $22 PID or $1A DID. A fresh cached value calls back straight away and returns
+        // GMLAN_PIDCACHE_HIT, otherwise the read joins one already pending or is queued
+        int read(int _id, int _service, int _identifier, GMLAN_ReadCallback _callback, void *_context = NULL);
+        // Collect finished transactions, call back and start the next ones. Call every loop
+        void update(void);
+        
+        // Cached value if still fresh, NULL otherwise
+        const char *lookup(int _id, int _service, int _identifier, int &_length);
+        void invalidate(int _id, int _service, int _identifier);
+        void invalidateAll(void) { cache.clear(); }
+        
+        void setTTL(int _service, int _identifier, uint32_t _ttl_us);
+        // Data bytes returned for a PID, needed before it can be packed with others
+        void setPIDLength(int _pid, int _length);
+        // PIDs the ECU accepts in one $22 request, 1 (the default) sends them one at a time
+        void setMaxPIDs(int _id, int _count);
+        
+        // Reads answered from the cache, reads that needed the bus, reads that joined another
+        // one and bus transactions made
+        uint32_t getHits(void) { return hits; }
+        uint32_t getMisses(void) { return misses; }
+        uint32_t getCoalesced(void) { return coalesced; }
+        uint32_t getTransactions(void) { return transactions; }
+        // Reads waiting or in flight
+        int pending(void);
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+GMLAN_Ring.h - Lock-free receive ring for GMLAN Library
+
+Single-producer / single-consumer ring used to hand raw frames from the CAN
+receive interrupt to the main loop without locking, allocating or calling into
+the request state machines from interrupt context. Typical use on mbed:
+
+    GMLAN_Ring<CANMessage, 64> rx;
+    
+    void on_can_rx() {
+        CANMessage msg;
+        while (can.read(msg)) rx.push(msg);
+    }
+    
+    can.attach(on_can_rx, CAN::RxIrq);
+    while (1) rx.drain(requests, request_count);
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifndef GMLAN_RING_H
+#define GMLAN_RING_H
+
+template <typename T, unsigned int N>
+class GMLAN_Ring {
+    /*
+    head is only written by the producer and tail only by the consumer, so one
+    acquire/release pair per side is all the synchronisation needed. The indexes
+    run freely and are masked on access, which is why N must be a power of two.
+    When the ring is full the new frame is dropped and counted rather than
+    overwriting one the consumer may be reading.
+    */
+    static_assert((N >= 2) && ((N & (N - 1)) == 0), "GMLAN_Ring size must be a power of two");
+    
+    private:
+        T items [N];
+        std::atomic<uint32_t> head, tail;
+        std::atomic<uint32_t> dropped, high_water;
+    
+    public:
+        // Main function
+        GMLAN_Ring() : head(0), tail(0), dropped(0), high_water(0) { }
+        
+        // Producer side (interrupt context), returns false and counts an overflow when full
+        bool push(const T &item) {
+            uint32_t h = head.load(std::memory_order_relaxed);
+            uint32_t used = h - tail.load(std::memory_order_acquire);
+            if (used >= N) {
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+            items[h & (N - 1)] = item;
+            head.store(h + 1, std::memory_order_release);
+            if (used + 1 > high_water.load(std::memory_order_relaxed)) high_water.store(used + 1, std::memory_order_relaxed);
+            return true;
+        }
+        
+        // Consumer side, take one frame
+        bool pop(T &item) {
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire)) return false;
+            item = items[t & (N - 1)];
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+        
+        // Consumer side, take up to _max frames in one go and release their slots together
+        unsigned int pop(T *_items, unsigned int _max) {
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            uint32_t available = head.load(std::memory_order_acquire) - t;
+            if (available > _max) available = _max;
+            for (uint32_t i = 0; i < available; i++) _items[i] = items[(t + i) & (N - 1)];
+            tail.store(t + available, std::memory_order_release);
+            return available;
+        }
+        
+        // Consumer side, feed every queued frame into each request's state machine
+        unsigned int drain(GMLAN_11Bit_Request **_requests, int _count, unsigned int _max = N) {
+            unsigned int handled = 0;
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            uint32_t available = head.load(std::memory_order_acquire) - t;
+            if (available > _max) available = _max;
+            for (; handled < available; handled++) {
+                const T &msg = items[(t + handled) & (N - 1)];
+                for (int r = 0; r < _count; r++) _requests[r]->processFrame(msg);
+            }
+            tail.store(t + handled, std::memory_order_release);
+            return handled;
+        }
+        
+        // Frames waiting to be consumed
+        unsigned int size(void) const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+        bool empty(void) const { return size() == 0; }
+        unsigned int capacity(void) const { return N; }
+        
+        // Frames dropped because the ring was full, and the deepest the ring has been
+        uint32_t overflows(void) const { return dropped.load(std::memory_order_relaxed); }
+        uint32_t highWater(void) const { return high_water.load(std::memory_order_relaxed); }
+        void resetStats(void) { dropped.store(0, std::memory_order_relaxed); high_water.store(0, std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,179 @@
+/*
+GMLAN_Scheduler.cpp - Cyclic transmission scheduler for GMLAN Library
+
+Keeps any number of periodic frames on the bus from a single timer wheel instead
+of one Ticker per message.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Scheduler.h"
+
+GMLAN_Scheduler::GMLAN_Scheduler(uint32_t _tick_us) {
+    for (int i = 0; i < L0_SIZE; i++) wheel0[i] = -1;
+    for (int i = 0; i < L1_SIZE; i++) wheel1[i] = -1;
+    overflow = free_list = -1;
+    tick_us = (_tick_us == 0) ? 1 : _tick_us;
+    last_now = 0;
+    current = elapsed_us = 0;
+    started = false;
+}
+void GMLAN_Scheduler::link(int _handle) {
+    Entry &e = entries[_handle];
+    int *head;
+    if ((e.due - current) < (uint64_t)L0_SIZE) {
+        e.level = 0;
+        head = &wheel0[e.due & (L0_SIZE - 1)];
+    } else if (((e.due >> L0_BITS) - (current >> L0_BITS)) < (uint64_t)L1_SIZE) {
+        e.level = 1;
+        head = &wheel1[(e.due >> L0_BITS) & (L1_SIZE - 1)];
+    } else {
+        e.level = 2;
+        head = &overflow;
+    }
+    e.prev = -1;
+    e.next = *head;
+    if (*head >= 0) entries[*head].prev = _handle;
+    *head = _handle;
+}
+void GMLAN_Scheduler::unlink(int _handle) {
+    Entry &e = entries[_handle];
+    // Already out of the wheel, e.g. while it is being fired
+    if (e.level < 0) return;
+    if (e.prev >= 0) entries[e.prev].next = e.next;
+    else if (e.level == 0) wheel0[e.due & (L0_SIZE - 1)] = e.next;
+    else if (e.level == 1) wheel1[(e.due >> L0_BITS) & (L1_SIZE - 1)] = e.next;
+    else overflow = e.next;
+    if (e.next >= 0) entries[e.next].prev = e.prev;
+    e.next = e.prev = e.level = -1;
+}
+int GMLAN_Scheduler::add(const CANMessage &msg, uint32_t _period_ms, uint32_t _offset_ms) {
+    uint64_t period = ((uint64_t)_period_ms * 1000) / tick_us;
+    if (period == 0) period = 1;
+    if (period > 0xFFFFFFFF) return -1;
+    uint64_t offset = ((uint64_t)_offset_ms * 1000) / tick_us;
+    
+    int handle = free_list;
+    if (handle >= 0) free_list = entries[handle].next;
+    else {
+        entries.push_back(Entry());
+        handle = entries.size() - 1;
+    }
+    Entry &e = entries[handle];
+    e.msg = msg;
+    e.period = period;
+    e.due = current + ((offset == 0) ? 1 : offset);
+    e.active = true;
+    memset(&e.stats, 0, sizeof(e.stats));
+    e.late_total = 0;
+    link(handle);
+    return handle;
+}
+int GMLAN_Scheduler::addTesterPresent(int _id, uint32_t _period_ms, uint32_t _offset_ms) {
+    // Let the request class build the single frame so padding matches every other request
+    GMLAN_11Bit_Request req(_id, vector<char>(1, GMLAN_SID_TESTER_PRESENT), false);
+    req.start();
+    return add(req.getNextFrame(), _period_ms, _offset_ms);
+}
+bool GMLAN_Scheduler::remove(int _handle) {
+    if ((_handle < 0) || (_handle >= (int)entries.size()) || !entries[_handle].active) return false;
+    unlink(_handle);
+    Entry &e = entries[_handle];
+    e.active = false;
+    e.next = free_list;
+    free_list = _handle;
+    return true;
+}
+bool GMLAN_Scheduler::update(int _handle, const char *_data, int _length) {
+    if ((_handle < 0) || (_handle >= (int)entries.size()) || !entries[_handle].active) return false;
+    if ((_length < 0) || (_length > 8)) return false;
+    CANMessage &msg = entries[_handle].msg;
+    memcpy(msg.data, _data, _length);
+    msg.len = _length;
+    return true;
+}
+bool GMLAN_Scheduler::update(int _handle, const CANMessage &msg) {
+    if ((_handle < 0) || (_handle >= (int)entries.size()) || !entries[_handle].active) return false;
+    entries[_handle].msg = msg;
+    return true;
+}
+void GMLAN_Scheduler::fire(int _handle, uint64_t _target, GMLAN_SendCallback _send, void *_context) {
+    // The callback may add() (growing entries) or remove() this very frame, so nothing
+    // is held across it
+    unlink(_handle);
+    CANMessage msg = entries[_handle].msg;
+    uint64_t ideal_us = entries[_handle].due * tick_us;
+    uint32_t late = (elapsed_us > ideal_us) ? (uint32_t)(elapsed_us - ideal_us) : 0;
+    bool sent = _send(msg, _context);
+    
+    Entry &e = entries[_handle];
+    // Removed during the callback, and possibly handed out again by add() already
+    if (!e.active || (e.level >= 0)) return;
+    if (sent) {
+        e.stats.sent++;
+        e.late_total += late;
+        if (late > e.stats.max_late_us) e.stats.max_late_us = late;
+        e.stats.mean_late_us = e.late_total / e.stats.sent;
+    } else e.stats.failed++;
+    
+    // Next slot on the ideal grid, skipping any the poll has already run past
+    e.due += e.period;
+    if (e.due <= _target) {
+        uint64_t skipped = ((_target - e.due) / e.period) + 1;
+        e.stats.missed += skipped;
+        e.due += skipped * e.period;
+    }
+    link(_handle);
+}
+int GMLAN_Scheduler::poll(uint32_t now_us, GMLAN_SendCallback _send, void *_context) {
+    if (!started) {
+        started = true;
+        last_now = now_us;
+    }
+    // 64-bit elapsed time so the wrapping ticker never confuses the wheel
+    elapsed_us += (uint32_t)(now_us - last_now);
+    last_now = now_us;
+    uint64_t target = elapsed_us / tick_us;
+    
+    int sent = 0;
+    while (current < target) {
+        current++;
+        if ((current & (L0_SIZE - 1)) == 0) {
+            // Lower wheel wrapped, pull the next block of entries down a level
+            if (((current >> L0_BITS) & (L1_SIZE - 1)) == 0) {
+                int i = overflow;
+                overflow = -1;
+                while (i >= 0) {
+                    int next = entries[i].next;
+                    link(i);
+                    i = next;
+                }
+            }
+            int slot = (current >> L0_BITS) & (L1_SIZE - 1);
+            int i = wheel1[slot];
+            wheel1[slot] = -1;
+            while (i >= 0) {
+                int next = entries[i].next;
+                link(i);
+                i = next;
+            }
+        }
+        
+        // One at a time from the head, so a callback removing another frame due now is safe.
+        // A fired frame is always re-linked into a later slot
+        int slot = current & (L0_SIZE - 1);
+        while (wheel0[slot] >= 0) {
+            fire(wheel0[slot], target, _send, _context);
+            sent++;
+        }
+    }
+    return sent;
+}
+const GMLAN_SchedulerStats *GMLAN_Scheduler::getStats(int _handle) {
+    if ((_handle < 0) || (_handle >= (int)entries.size()) || !entries[_handle].active) return NULL;
+    return &entries[_handle].stats;
+}
+void GMLAN_Scheduler::resetStats(int _handle) {
+    if ((_handle < 0) || (_handle >= (int)entries.size()) || !entries[_handle].active) return;
+    memset(&entries[_handle].stats, 0, sizeof(GMLAN_SchedulerStats));
+    entries[_handle].late_total = 0;
+}
@@ -0,0 +1,98 @@
+/*
+GMLAN_Scheduler.h - Cyclic transmission scheduler for GMLAN Library
+
+Keeps any number of periodic frames on the bus (tester present to each ECU in a
+diagnostic session, emulated power mode or chime broadcasts built with
+GMLAN_Message, keep-alives...) from a single timer wheel instead of one Ticker
+per message.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_SCHEDULER_H
+#define GMLAN_SCHEDULER_H
+
+// Called for every frame that falls due, return false if it couldn't be queued for transmission
+typedef bool (*GMLAN_SendCallback)(const CANMessage &msg, void *context);
+
+struct GMLAN_SchedulerStats {
+    uint32_t sent;
+    uint32_t missed;        // periods skipped because poll() was called too late
+    uint32_t failed;        // sends the callback refused
+    uint32_t max_late_us;   // worst lateness against the ideal schedule
+    uint32_t mean_late_us;
+};
+
+class GMLAN_Scheduler {
+    /*
+    Hierarchical timer wheel: 256 one-tick slots, then 64 slots of 256 ticks, then
+    an overflow list for anything further out (beyond 16384 ticks, 16 seconds at the
+    default 1ms tick). Entries drop a level each time the wheel below wraps, so each
+    tick costs a constant amount of work plus the frames actually sent.
+    
+    Frames are generated once when added and sent from the stored copy; update()
+    rewrites the payload in place for signals that change (counters, status bits).
+    Each frame is rescheduled from its ideal due time rather than from when it was
+    actually sent, so late polls show up as jitter instead of accumulating drift.
+    
+    Example:
+    
+        GMLAN_Scheduler cyclic;
+        int power = cyclic.add(GMLAN_Message(0x4, GMLAN_ARBID_SYSTEM_POWER_MODE, 0x40, 0x05).generate(), 100);
+        cyclic.addTesterPresent(GMLAN_REQUEST_TO_ALL_NODES, 2000);
+        while (1) cyclic.poll(us_ticker_read(), send_frame, &can);
+    */
+    private:
+        static const int L0_BITS = 8;
+        static const int L0_SIZE = 1 << L0_BITS;
+        static const int L1_BITS = 6;
+        static const int L1_SIZE = 1 << L1_BITS;
+        
+        struct Entry {
+            CANMessage msg;
+            uint32_t period;
+            uint64_t due;
+            int next, prev, level;
+            bool active;
+            GMLAN_SchedulerStats stats;
+            uint64_t late_total;
+        };
+        
+        vector<Entry> entries;
+        int wheel0 [L0_SIZE], wheel1 [L1_SIZE], overflow, free_list;
+        uint32_t tick_us, last_now;
+        uint64_t current, elapsed_us;
+        bool started;
+        
+        void link(int _handle);
+        void unlink(int _handle);
+        void fire(int _handle, uint64_t _target, GMLAN_SendCallback _send, void *_context);
+    
+    public:
+        // Main function, _tick_us sets the resolution of periods and offsets
+        GMLAN_Scheduler(uint32_t _tick_us = 1000);
+        
+        // Start sending a frame every _period_ms, first after _offset_ms. Returns a handle or -1
+        int add(const CANMessage &msg, uint32_t _period_ms, uint32_t _offset_ms = 0);
+        // Single frame tester present ($3E) to keep a diagnostic session open
+        int addTesterPresent(int _id, uint32_t _period_ms = 2000, uint32_t _offset_ms = 0);
+        // Stop a frame and free its handle
+        bool remove(int _handle);
+        
+        // Change what a frame carries without disturbing its schedule
+        bool update(int _handle, const char *_data, int _length);
+        bool update(int _handle, const CANMessage &msg);
+        
+        // Advance to now_us (a free running microsecond count such as us_ticker_read())
+        // and send everything due. Returns the number of frames sent
+        int poll(uint32_t now_us, GMLAN_SendCallback _send, void *_context = NULL);
+        
+        // Timing statistics for one frame, NULL for unknown handles
+        const GMLAN_SchedulerStats *getStats(int _handle);
+        void resetStats(int _handle);
+};
+
+#endif
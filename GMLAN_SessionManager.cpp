@@ -0,0 +1,157 @@
+/*
+GMLAN_SessionManager.cpp - Concurrent 11-bit diagnostic sessions for GMLAN Library
+
+Owns many GMLAN_11Bit_Request conversations at once, one in flight per ECU, so a
+scan of BCM, TDM, EBCM, EHU, IPC, HVAC and friends overlaps instead of running
+back to back. Received frames are routed to their session through a table indexed
+by the low byte of the ID (the same byte GMLAN_11Bit_Request matches on) and
+transmit frames from all sessions are interleaved round robin.
+*/
+
+#include "mbed.h"
+#include "GMLAN_SessionManager.h"
+
+GMLAN_SessionManager::GMLAN_SessionManager() {
+    for (int i = 0; i < 256; i++) route[i] = -1;
+    cursor = running = 0;
+    max_retries = 2;
+    retried = 0;
+    receive_timeout = 0;
+    callback = NULL;
+    callback_context = NULL;
+}
+GMLAN_SessionManager::~GMLAN_SessionManager() {
+    for (size_t i = 0; i < sessions.size(); i++) delete sessions[i].request;
+}
+int GMLAN_SessionManager::submit(int _id, vector<char> _request, bool _await_response, bool _handle_flowcontrol) {
+    // Reuse a released slot before growing
+    int handle = -1;
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].request == NULL) {
+            handle = i;
+            break;
+        }
+    }
+    if (handle < 0) {
+        if (sessions.size() >= 0x7FFF) return -1;
+        Session empty = { NULL, 0, false, 0 };
+        sessions.push_back(empty);
+        handle = sessions.size() - 1;
+    }
+    
+    Session &session = sessions[handle];
+    session.request = new GMLAN_11Bit_Request(_id, _request, _await_response, _handle_flowcontrol);
+    session.request->setReceiveTimeout(receive_timeout);
+    session.last_activity = us_ticker_read();
+    session.finished = false;
+    session.attempts = 0;
+    running++;
+    return handle;
+}
+void GMLAN_SessionManager::release(int _handle) {
+    if ((_handle < 0) || (_handle >= (int)sessions.size()) || (sessions[_handle].request == NULL)) return;
+    GMLAN_11Bit_Request *request = sessions[_handle].request;
+    if (!sessions[_handle].finished) {
+        // Released while still running, treat as aborted
+        request->abort();
+        finish(_handle);
+        // The completion callback may have submitted (growing sessions) or released this one itself
+        if (sessions[_handle].request != request) return;
+    }
+    sessions[_handle].request = NULL;
+    delete request;
+}
+void GMLAN_SessionManager::finish(int _handle) {
+    Session &session = sessions[_handle];
+    if (session.finished) return;
+    session.finished = true;
+    running--;
+    int ecu = session.request->getID() & 0xFF;
+    if (route[ecu] == _handle) route[ecu] = -1;
+    if (callback != NULL) callback(_handle, *session.request, callback_context);
+}
+bool GMLAN_SessionManager::settle(int _handle) {
+    Session &session = sessions[_handle];
+    GMLAN_11Bit_Request &req = *session.request;
+    if (req.receiveFailed() && (session.attempts < max_retries)) {
+        // The ECU is answering, just not intact, so ask again now instead of waiting for expire().
+        // The session keeps its route so the retry goes out on the next getNextFrame()
+        session.attempts++;
+        retried++;
+        req.reset();
+        return false;
+    }
+    if (!isFinished(req.getState())) return false;
+    finish(_handle);
+    return true;
+}
+bool GMLAN_SessionManager::getNextFrame(CANMessage &msg) {
+    uint32_t now = us_ticker_read();
+    int count = sessions.size();
+    for (int n = 0; n < count; n++) {
+        // Round robin so one long transfer can't starve the other ECUs
+        int i = (cursor + n) % count;
+        Session &session = sessions[i];
+        if ((session.request == NULL) || session.finished) continue;
+        GMLAN_11Bit_Request &req = *session.request;
+        int ecu = req.getID() & 0xFF;
+        
+        if (req.getState() == GMLAN_STATE_READY_TO_SEND) {
+            // Only one conversation per ECU, responses can't be told apart otherwise
+            if ((route[ecu] >= 0) && (route[ecu] != i)) continue;
+            route[ecu] = i;
+            req.start();
+        }
+        if (req.getState() == GMLAN_STATE_SEND_DATA) {
+            // Respect the ECU's STmin, other sessions can use the gap
+            if (!req.frameDue(now)) continue;
+            msg = req.getNextFrame(now);
+        } else if (req.getState() == GMLAN_STATE_SEND_FC) msg = req.getFlowControl(now);
+        else continue;
+        
+        session.last_activity = now;
+        cursor = (i + 1) % count;
+        settle(i);
+        return true;
+    }
+    return false;
+}
+void GMLAN_SessionManager::processFrame(const CANMessage &msg) {
+    if (msg.format != CANStandard) return;
+    int handle = route[msg.id & 0xFF];
+    if (handle < 0) return;
+    
+    Session &session = sessions[handle];
+    uint32_t now = us_ticker_read();
+    session.request->processFrame(msg, now);
+    session.last_activity = now;
+    settle(handle);
+}
+int GMLAN_SessionManager::expire(uint32_t _timeout_us) {
+    int expired = 0;
+    uint32_t now = us_ticker_read();
+    for (size_t i = 0; i < sessions.size(); i++) {
+        Session &session = sessions[i];
+        if ((session.request == NULL) || session.finished) continue;
+        // Queued sessions haven't been sent yet so they can't have timed out
+        if (session.request->getState() == GMLAN_STATE_READY_TO_SEND) continue;
+        if (session.request->checkTimeout(now)) {
+            if (settle(i)) expired++;
+            continue;
+        }
+        if ((uint32_t)(now - session.last_activity) > _timeout_us) {
+            session.request->abort();
+            finish(i);
+            expired++;
+        }
+    }
+    return expired;
+}
+GMLAN_11Bit_Request *GMLAN_SessionManager::getRequest(int _handle) {
+    if ((_handle < 0) || (_handle >= (int)sessions.size())) return NULL;
+    return sessions[_handle].request;
+}
+int GMLAN_SessionManager::getState(int _handle) {
+    GMLAN_11Bit_Request *req = getRequest(_handle);
+    return (req == NULL) ? GMLAN_STATE_ERROR : req->getState();
+}
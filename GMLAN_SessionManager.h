@@ -0,0 +1,104 @@
+/*
+GMLAN_SessionManager.h - Concurrent 11-bit diagnostic sessions for GMLAN Library
+
+Owns many GMLAN_11Bit_Request conversations at once, one in flight per ECU, so a
+scan of BCM, TDM, EBCM, EHU, IPC, HVAC and friends overlaps instead of running
+back to back. Received frames are routed to their session through a table indexed
+by the low byte of the ID (the same byte GMLAN_11Bit_Request matches on) and
+transmit frames from all sessions are interleaved round robin.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_SESSIONMANAGER_H
+#define GMLAN_SESSIONMANAGER_H
+
+// Called once when a session reaches GMLAN_STATE_COMPLETED or one of the error states
+typedef void (*GMLAN_SessionCallback)(int handle, GMLAN_11Bit_Request &request, void *context);
+
+class GMLAN_SessionManager {
+    /*
+    Requests to an ECU that already has a conversation open are held back until it
+    finishes, the rest start immediately. A session stays around after it finishes
+    so its state and response can be read, release() hands the slot back.
+    Consecutive frames go out as soon as each ECU's flow control allows, sessions
+    still inside their STmin gap are skipped so the others can use the bus.
+    
+    A response that breaks off part way (a lost consecutive frame, or nothing for
+    longer than the receive timeout) is asked for again straight away, up to
+    setRetries() times, before the session finishes in GMLAN_STATE_SEQUENCE_ERROR or
+    GMLAN_STATE_TIMEOUT. The receive timeout is checked from expire().
+    
+    Example:
+    
+        GMLAN_SessionManager sessions;
+        sessions.submit(GMLAN_TO_BCM, read_vin);
+        sessions.submit(GMLAN_TO_IPC, read_vin);
+        
+        CANMessage msg;
+        while (sessions.active() > 0) {
+            while (sessions.getNextFrame(msg)) can.write(msg);
+            while (can.read(msg)) sessions.processFrame(msg);
+            sessions.expire(250000);
+        }
+    */
+    private:
+        struct Session {
+            GMLAN_11Bit_Request *request;
+            uint32_t last_activity;
+            bool finished;
+            int attempts;
+        };
+        
+        vector<Session> sessions;
+        int16_t route [256];
+        int cursor, running;
+        int max_retries, retried;
+        uint32_t receive_timeout;
+        GMLAN_SessionCallback callback;
+        void *callback_context;
+        
+        bool isFinished(int _state) { return _state >= GMLAN_STATE_COMPLETED; }
+        void finish(int _handle);
+        // Retry a broken off response or finish the session, whichever applies. Returns true if
+        // it finished, the completion callback may have grown sessions by then
+        bool settle(int _handle);
+    
+    public:
+        // Main function
+        GMLAN_SessionManager();
+        ~GMLAN_SessionManager();
+        
+        // Queue a request, returns a handle for it or -1 if it could not be queued
+        int submit(int _id, vector<char> _request, bool _await_response = true, bool _handle_flowcontrol = true);
+        // Free a session once its result has been collected
+        void release(int _handle);
+        
+        // Next frame to put on the bus from any session, false when nothing is due
+        bool getNextFrame(CANMessage &msg);
+        // Route a received frame to the session waiting on its ID
+        void processFrame(const CANMessage &msg);
+        // Abort sessions that have waited longer than _timeout_us, returns how many were aborted
+        int expire(uint32_t _timeout_us);
+        
+        // Times a response that broke off is requested again, defaults to 2
+        void setRetries(int _retries) { max_retries = (_retries < 0) ? 0 : _retries; }
+        // N_Cr applied to new sessions, 0 (the default) leaves it to expire()'s timeout
+        void setReceiveTimeout(uint32_t _timeout_us) { receive_timeout = _timeout_us; }
+        // Requests sent again since construction
+        int getRetried(void) { return retried; }
+        
+        // Completion notification
+        void onComplete(GMLAN_SessionCallback _callback, void *_context = NULL) { callback = _callback; callback_context = _context; }
+        
+        // Session access, NULL / error for unknown handles
+        GMLAN_11Bit_Request *getRequest(int _handle);
+        int getState(int _handle);
+        // Sessions submitted but not yet finished
+        int active(void) { return running; }
+};
+
+#endif
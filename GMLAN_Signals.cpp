@@ -0,0 +1,145 @@
+/*
+GMLAN_Signals.cpp - Signal decoding for GMLAN Library
+
+Turns the payload of 29-bit broadcast frames into physical values from a table
+of signal definitions, using the same start bit / length / byte order / scale /
+offset description as a DBC file. Definitions are compiled once into shifts and
+masks over the 8 byte payload read as a single 64-bit word.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Signals.h"
+#include <algorithm>
+
+// Frames are gathered this many at a time for batch extraction
+#define GMLAN_SIGNALS_BATCH 256
+
+static bool compareSignals(const GMLAN_Signal *a, const GMLAN_Signal *b) {
+    return a->arbitration < b->arbitration;
+}
+
+// Payload as one word, byte 0 in the top bits for Motorola and the bottom bits for Intel
+static inline uint64_t payloadWord(const CANMessage &msg, bool _big_endian) {
+    uint64_t word = 0;
+    int len = (msg.len > 8) ? 8 : msg.len;
+    if (_big_endian) {
+        for (int i = 0; i < 8; i++) word = (word << 8) | ((i < len) ? msg.data[i] : 0);
+    } else {
+        for (int i = 7; i >= 0; i--) word = (word << 8) | ((i < len) ? msg.data[i] : 0);
+    }
+    return word;
+}
+
+static inline float extract(uint64_t word, const uint8_t shift, const uint8_t length, const uint64_t mask, const bool is_signed) {
+    if (is_signed) {
+        // Move the field to the top of the word and arithmetic shift it back down to sign extend
+        int64_t value = (int64_t)(word << (64 - shift - length)) >> (64 - length);
+        return (float)value;
+    }
+    return (float)((word >> shift) & mask);
+}
+
+GMLAN_SignalDecoder::GMLAN_SignalDecoder(const GMLAN_Signal *_signals, int _count) {
+    // Stable sort keeps the table order within each arbitration ID
+    vector<const GMLAN_Signal *> sorted;
+    for (int i = 0; i < _count; i++) {
+        if ((_signals[i].length == 0) || (_signals[i].length > 64) || (_signals[i].start_bit > 63)) continue;
+        sorted.push_back(&_signals[i]);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), compareSignals);
+    
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const GMLAN_Signal &sig = *sorted[i];
+        Compiled c;
+        int lsb;
+        if (sig.big_endian) {
+            // Motorola start bit is the MSB in byte / bit numbering, convert to a position in the big endian word
+            int msb = ((7 - (sig.start_bit / 8)) * 8) + (sig.start_bit % 8);
+            lsb = msb - (sig.length - 1);
+        } else lsb = sig.start_bit;
+        if ((lsb < 0) || (lsb + sig.length > 64)) continue;
+        
+        c.shift = lsb;
+        c.length = sig.length;
+        c.big_endian = sig.big_endian;
+        c.is_signed = sig.is_signed;
+        c.mask = (sig.length == 64) ? ~0ULL : ((1ULL << sig.length) - 1);
+        c.scale = sig.scale;
+        c.offset = sig.offset;
+        
+        if (groups.empty() || (groups.back().arbitration != sig.arbitration)) {
+            Group g = { sig.arbitration, (int)compiled.size(), 0 };
+            groups.push_back(g);
+        }
+        if (groups.back().count >= GMLAN_SIGNALS_PER_FRAME) continue;
+        compiled.push_back(c);
+        groups.back().count++;
+    }
+}
+const GMLAN_SignalDecoder::Group *GMLAN_SignalDecoder::find(int _arbitration) const {
+    size_t low = 0, high = groups.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (groups[mid].arbitration < _arbitration) low = mid + 1;
+        else high = mid;
+    }
+    if ((low < groups.size()) && (groups[low].arbitration == _arbitration)) return &groups[low];
+    return NULL;
+}
+int GMLAN_SignalDecoder::count(int _arbitration) const {
+    const Group *g = find(_arbitration);
+    return (g == NULL) ? 0 : g->count;
+}
+int GMLAN_SignalDecoder::decode(const CANMessage &msg, float *values) const {
+    if (msg.format != CANExtended) return -1;
+    CANHeader hdr;
+    hdr.decode(msg.id);
+    const Group *g = find(hdr.arbitration());
+    if (g == NULL) return -1;
+    
+    uint64_t little = payloadWord(msg, false);
+    uint64_t big = payloadWord(msg, true);
+    for (int i = 0; i < g->count; i++) {
+        const Compiled &c = compiled[g->first + i];
+        values[i] = (extract(c.big_endian ? big : little, c.shift, c.length, c.mask, c.is_signed) * c.scale) + c.offset;
+    }
+    return g->count;
+}
+int GMLAN_SignalDecoder::decodeBatch(const CANMessage *frames, int _count, int _arbitration, float **columns) const {
+    const Group *g = find(_arbitration);
+    if (g == NULL) return 0;
+    
+    uint64_t little [GMLAN_SIGNALS_BATCH], big [GMLAN_SIGNALS_BATCH];
+    int rows = 0;
+    int next = 0;
+    while (next < _count) {
+        // Gather the payloads of matching frames, both byte orders
+        int gathered = 0;
+        for (; (next < _count) && (gathered < GMLAN_SIGNALS_BATCH); next++) {
+            const CANMessage &msg = frames[next];
+            if (msg.format != CANExtended) continue;
+            // Same field CANHeader::decode reads, inlined for the gather loop
+            if ((int)((msg.id >> 13) & 0x1FFF) != _arbitration) continue;
+            little[gathered] = payloadWord(msg, false);
+            big[gathered] = payloadWord(msg, true);
+            gathered++;
+        }
+        
+        // Then one straight line loop per signal
+        for (int s = 0; s < g->count; s++) {
+            const Compiled &c = compiled[g->first + s];
+            const uint64_t *words = c.big_endian ? big : little;
+            float *out = columns[s] + rows;
+            const uint8_t shift = c.shift, length = c.length;
+            const uint64_t mask = c.mask;
+            const float scale = c.scale, offset = c.offset;
+            if (c.is_signed) {
+                for (int i = 0; i < gathered; i++) out[i] = ((float)((int64_t)(words[i] << (64 - shift - length)) >> (64 - length)) * scale) + offset;
+            } else {
+                for (int i = 0; i < gathered; i++) out[i] = ((float)((words[i] >> shift) & mask) * scale) + offset;
+            }
+        }
+        rows += gathered;
+    }
+    return rows;
+}
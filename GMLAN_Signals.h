@@ -0,0 +1,85 @@
+/*
+GMLAN_Signals.h - Signal decoding for GMLAN Library
+
+Turns the payload of 29-bit broadcast frames into physical values from a table
+of signal definitions, using the same start bit / length / byte order / scale /
+offset description as a DBC file. Definitions are compiled once into shifts and
+masks over the 8 byte payload read as a single 64-bit word.
+
+Example:
+
+    const GMLAN_Signal signals [] = {
+        // arbid,                               start, len, big endian, signed, scale, offset, name
+        { GMLAN_ARBID_BATTERY_VOLTAGE,             7,   8,  true,      false,  0.1f,  0.0f,   "battery_voltage" },
+    };
+    GMLAN_SignalDecoder decoder(signals, 1);
+    
+    float values [GMLAN_SIGNALS_PER_FRAME];
+    int count = decoder.decode(msg, values);
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_SIGNALS_H
+#define GMLAN_SIGNALS_H
+
+// Most signals one arbitration ID can carry (one per payload bit)
+#define GMLAN_SIGNALS_PER_FRAME 64
+
+struct GMLAN_Signal {
+    int arbitration;
+    // DBC convention: LSB position for little endian, MSB position for big endian (Motorola)
+    uint8_t start_bit;
+    uint8_t length;
+    bool big_endian;
+    bool is_signed;
+    float scale, offset;
+    const char *name;
+};
+
+class GMLAN_SignalDecoder {
+    /*
+    Signals are grouped by arbitration ID in the order they appear in the table,
+    so decode() writes values[i] for the i-th definition with that ID.
+    
+    decodeBatch() is for offline analysis of logged traffic. It first gathers the
+    payload words of every matching frame, then extracts one signal at a time
+    across all of them into its own column, which keeps each inner loop a plain
+    shift / mask / multiply-add the compiler can vectorise.
+    */
+    private:
+        struct Compiled {
+            uint8_t shift, length;
+            bool big_endian, is_signed;
+            uint64_t mask;
+            float scale, offset;
+        };
+        struct Group {
+            int arbitration;
+            int first, count;
+        };
+        
+        vector<Compiled> compiled;
+        vector<Group> groups;
+        
+        const Group *find(int _arbitration) const;
+    
+    public:
+        // Main function, the table is compiled here and not referenced afterwards (names included)
+        GMLAN_SignalDecoder(const GMLAN_Signal *_signals, int _count);
+        
+        // Number of signals defined for an arbitration ID
+        int count(int _arbitration) const;
+        
+        // Decode every signal of one frame into values[], returns how many or -1 if the ID has none
+        int decode(const CANMessage &msg, float *values) const;
+        
+        // Decode every frame with the given arbitration ID into columns[signal][row],
+        // each column needs room for _count rows. Returns the number of rows written
+        int decodeBatch(const CANMessage *frames, int _count, int _arbitration, float **columns) const;
+};
+
+#endif
@@ -0,0 +1,367 @@
+/*
+GMLAN_Simulator.cpp - Virtual bus and ECU simulator for GMLAN Library
+
+Simulated ECUs, bus arbitration and the broadcast traffic generator.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Simulator.h"
+
+// Broadcast frames allowed to back up before the generator drops them
+#define GMLAN_SIM_BROADCAST_DEPTH 32
+
+// Drop the consumed front of a queue once it is most of the storage
+template <typename T>
+static void compact(vector<T> &queue, size_t &head) {
+    if (head == queue.size()) {
+        queue.clear();
+        head = 0;
+    } else if (head >= 64 && head >= queue.size() / 2) {
+        queue.erase(queue.begin(), queue.begin() + head);
+        head = 0;
+    }
+}
+
+static uint32_t separationTimeToNanoseconds(int _separation_time) {
+    // Same ISO 15765-2 STmin encoding as GMLAN_11Bit_Request
+    if (_separation_time <= 0x7F) return _separation_time * 1000000;
+    if ((_separation_time >= 0xF1) && (_separation_time <= 0xF9)) return (_separation_time - 0xF0) * 100000;
+    return 0x7F * 1000000;
+}
+
+GMLAN_SimulatedECU::GMLAN_SimulatedECU(int _request_id) {
+    request_id = _request_id;
+    response_id = _request_id + 0x400;
+    response_delay_ns = 1000000;
+    pending_count = pending_interval_ns = 0;
+    rx_block_size = rx_separation = 0;
+    rx_expected = rx_sequence = rx_block_remaining = 0;
+    tx_offset = tx_sequence = tx_block_remaining = 0;
+    tx_frames = drop_frame = 0;
+    tx_separation_ns = 0;
+    tx_awaiting_fc = false;
+    requests_seen = 0;
+}
+void GMLAN_SimulatedECU::addResponse(const vector<char> &_request, const vector<char> &_response) {
+    Response r;
+    r.request = _request;
+    r.response = _response;
+    responses.push_back(r);
+}
+void GMLAN_SimulatedECU::addNegative(const vector<char> &_request, int _nrc) {
+    vector<char> negative;
+    negative.push_back(GMLAN_SID_ERROR);
+    negative.push_back(_request.empty() ? 0 : _request[0]);
+    negative.push_back(_nrc);
+    addResponse(_request, negative);
+}
+void GMLAN_SimulatedECU::enqueue(uint64_t _ready_ns, const char *_data, int _length) {
+    char frame [8];
+    memset(frame, 0xAA, 8);
+    memcpy(frame, _data, (_length > 8) ? 8 : _length);
+    Outgoing o;
+    o.ready_ns = _ready_ns;
+    o.msg = CANMessage(response_id, frame, 8, CANData, CANStandard);
+    // Keep the queue in ready order, equal times in the order queued
+    size_t i = queue.size();
+    while ((i > 0) && (queue[i - 1].ready_ns > _ready_ns)) i--;
+    queue.insert(queue.begin() + i, o);
+}
+void GMLAN_SimulatedECU::respond(uint64_t _now_ns) {
+    requests_seen++;
+    rx_expected = 0;
+    
+    // Longest matching prefix wins
+    const vector<char> *reply = NULL;
+    size_t matched = 0;
+    for (size_t i = 0; i < responses.size(); i++) {
+        const vector<char> &prefix = responses[i].request;
+        if ((prefix.size() > rx_data.size()) || ((reply != NULL) && (prefix.size() <= matched))) continue;
+        if (!prefix.empty() && (memcmp(&prefix[0], &rx_data[0], prefix.size()) != 0)) continue;
+        reply = &responses[i].response;
+        matched = prefix.size();
+    }
+    char sid = rx_data.empty() ? 0 : rx_data[0];
+    vector<char> negative;
+    if (reply == NULL) {
+        negative.push_back(GMLAN_SID_ERROR);
+        negative.push_back(sid);
+        negative.push_back(GMLAN_NRC_SERVICE_NOT_SUPPORTED);
+        reply = &negative;
+    }
+    
+    uint64_t ready = _now_ns + response_delay_ns;
+    for (uint32_t i = 0; i < pending_count; i++) {
+        char pending [4] = { 0x03, GMLAN_SID_ERROR, sid, GMLAN_NRC_RESPONSE_PENDING };
+        enqueue(ready, pending, 4);
+        ready += pending_interval_ns;
+    }
+    
+    char frame [8];
+    int length = reply->size();
+    if (length <= 7) {
+        frame[0] = (GMLAN_PCI_UNSEGMENTED << 4) | length;
+        memcpy(&frame[1], &(*reply)[0], length);
+        enqueue(ready, frame, length + 1);
+        return;
+    }
+    tx_data = *reply;
+    frame[0] = (GMLAN_PCI_SEGMENTED << 4) | ((length >> 8) & 0xF);
+    frame[1] = length & 0xFF;
+    memcpy(&frame[2], &tx_data[0], 6);
+    tx_offset = 6;
+    tx_sequence = 1;
+    tx_frames = 0;
+    tx_awaiting_fc = true;
+    enqueue(ready, frame, 8);
+}
+void GMLAN_SimulatedECU::queueConsecutive(uint64_t _ready_ns) {
+    int chunk = (int)tx_data.size() - tx_offset;
+    if (chunk <= 0) return;
+    if (chunk > 7) chunk = 7;
+    char frame [8];
+    frame[0] = (GMLAN_PCI_ADDITIONAL << 4) | (tx_sequence & 0xF);
+    memcpy(&frame[1], &tx_data[tx_offset], chunk);
+    tx_offset += chunk;
+    tx_sequence = (tx_sequence + 1) & 0xF;
+    if (++tx_frames == drop_frame) {
+        // Lost on the way, the rest of the response carries on without it
+        drop_frame = 0;
+        queueConsecutive(_ready_ns);
+        return;
+    }
+    enqueue(_ready_ns, frame, chunk + 1);
+}
+void GMLAN_SimulatedECU::receive(const CANMessage &msg, uint64_t _now_ns) {
+    if ((msg.format != CANStandard) || ((int)msg.id != request_id) || (msg.len < 1)) return;
+    const unsigned char *data = (const unsigned char *)msg.data;
+    
+    switch ((data[0] >> 4) & 0xF) {
+        case GMLAN_PCI_UNSEGMENTED: {
+            int length = data[0] & 0xF;
+            if ((length == 0) || (length > 7)) return;
+            rx_data.assign(msg.data + 1, msg.data + 1 + length);
+            respond(_now_ns);
+            break;
+        }
+        case GMLAN_PCI_SEGMENTED: {
+            rx_expected = ((data[0] & 0xF) << 8) | data[1];
+            int first = (rx_expected < 6) ? rx_expected : 6;
+            rx_data.assign(msg.data + 2, msg.data + 2 + first);
+            rx_sequence = 1;
+            rx_block_remaining = rx_block_size;
+            char fc [3] = { (char)(GMLAN_PCI_FLOW_CONTROL << 4), (char)rx_block_size, (char)rx_separation };
+            enqueue(_now_ns, fc, 3);
+            break;
+        }
+        case GMLAN_PCI_ADDITIONAL: {
+            if (rx_expected == 0) return;
+            if ((data[0] & 0xF) != rx_sequence) {
+                // Out of order, drop the request as a real ECU would
+                rx_expected = 0;
+                return;
+            }
+            int chunk = rx_expected - (int)rx_data.size();
+            if (chunk > 7) chunk = 7;
+            rx_data.insert(rx_data.end(), msg.data + 1, msg.data + 1 + chunk);
+            rx_sequence = (rx_sequence + 1) & 0xF;
+            if ((int)rx_data.size() >= rx_expected) {
+                respond(_now_ns);
+            } else if ((rx_block_size > 0) && (--rx_block_remaining <= 0)) {
+                rx_block_remaining = rx_block_size;
+                char fc [3] = { (char)(GMLAN_PCI_FLOW_CONTROL << 4), (char)rx_block_size, (char)rx_separation };
+                enqueue(_now_ns, fc, 3);
+            }
+            break;
+        }
+        case GMLAN_PCI_FLOW_CONTROL: {
+            if (!tx_awaiting_fc) return;
+            int flow_status = data[0] & 0xF;
+            if (flow_status == 0x1) return;
+            tx_awaiting_fc = false;
+            if (flow_status != 0x0) {
+                // Overflow, give up on the response
+                tx_data.clear();
+                return;
+            }
+            // Negative remaining means no further flow control is expected
+            tx_block_remaining = (data[1] == 0) ? -1 : data[1];
+            tx_separation_ns = separationTimeToNanoseconds(data[2]);
+            queueConsecutive(_now_ns);
+            break;
+        }
+    }
+}
+bool GMLAN_SimulatedECU::peek(const CANMessage *&msg, uint64_t &_ready_ns) {
+    if (queue.empty()) return false;
+    msg = &queue[0].msg;
+    _ready_ns = queue[0].ready_ns;
+    return true;
+}
+void GMLAN_SimulatedECU::sent(uint64_t _now_ns) {
+    if (queue.empty()) return;
+    bool consecutive = ((queue[0].msg.data[0] >> 4) & 0xF) == GMLAN_PCI_ADDITIONAL;
+    queue.erase(queue.begin());
+    // A new request may have replaced the response while this frame was queued
+    if (!consecutive || tx_awaiting_fc || (tx_offset >= (int)tx_data.size())) return;
+    // STmin runs from the end of the frame just sent
+    if ((tx_block_remaining > 0) && (--tx_block_remaining == 0)) tx_awaiting_fc = true;
+    else queueConsecutive(_now_ns + tx_separation_ns);
+}
+
+GMLAN_VirtualBus::GMLAN_VirtualBus(uint32_t _baud, uint32_t _rx_depth, uint32_t _tx_depth) : tx_queue(_baud, _tx_depth) {
+    baud = _baud;
+    now_ns = busy_ns = 0;
+    rx_head = 0;
+    tx_depth = _tx_depth;
+    rx_depth = _rx_depth;
+    broadcast_load = 0.0f;
+    broadcast_seed = 1;
+    broadcast_next_ns = 0;
+    broadcast_head = 0;
+    frames_carried = rx_dropped = broadcast_dropped = 0;
+}
+void GMLAN_VirtualBus::setBroadcastLoad(float _load, uint32_t _seed) {
+    broadcast_load = (_load < 0.0f) ? 0.0f : ((_load > 1.0f) ? 1.0f : _load);
+    broadcast_seed = _seed ? _seed : 1;
+    broadcast_next_ns = now_ns;
+}
+void GMLAN_VirtualBus::generateBroadcast(void) {
+    // A typical mix of body and powertrain status frames from a handful of senders
+    static const int arbids [8] = {
+        GMLAN_ARBID_SYSTEM_POWER_MODE, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION,
+        GMLAN_ARBID_ENGINE_INFORMATION_1, GMLAN_ARBID_BATTERY_VOLTAGE,
+        GMLAN_ARBID_FUEL_INFORMATION, GMLAN_ARBID_TRANSMISSION_GEAR_INFORMATION,
+        GMLAN_ARBID_LIGHTING_STATUS, GMLAN_ARBID_DRIVER_DOOR_STATUS
+    };
+    static const int senders [4] = { 0x40, 0x60, 0x80, 0x97 };
+    
+    while ((broadcast_load > 0.0f) && (broadcast_next_ns <= now_ns)) {
+        char data [8];
+        for (int i = 0; i < 8; i++) {
+            // xorshift32, cheap and the same sequence for the same seed
+            broadcast_seed ^= broadcast_seed << 13;
+            broadcast_seed ^= broadcast_seed >> 17;
+            broadcast_seed ^= broadcast_seed << 5;
+            data[i] = broadcast_seed;
+        }
+        uint32_t pick = broadcast_seed >> 8;
+        uint32_t id = gmlan_encode29bit(2 + (pick % 6), arbids[(pick >> 3) & 7], senders[(pick >> 6) & 3]);
+        CANMessage msg(id, data, 8, CANData, CANExtended);
+        
+        if (broadcast_queue.size() - broadcast_head >= GMLAN_SIM_BROADCAST_DEPTH) broadcast_dropped++;
+        else broadcast_queue.push_back(msg);
+        broadcast_next_ns += (uint64_t)(GMLAN_TXQueue::frameTime(msg, baud) / broadcast_load);
+    }
+}
+bool GMLAN_VirtualBus::accepts(const CANMessage &msg) {
+    if (filters.empty()) return true;
+    for (size_t i = 0; i < filters.size(); i++) {
+        const Filter &f = filters[i];
+        if ((f.format != CANAny) && (f.format != msg.format)) continue;
+        if (((msg.id ^ f.id) & f.mask) == 0) return true;
+    }
+    return false;
+}
+void GMLAN_VirtualBus::deliver(const CANMessage &msg, int _sender) {
+    // _sender is the ECU index, -1 for the tester and -2 for the broadcast generator
+    if ((_sender != -1) && accepts(msg)) {
+        if (rx_queue.size() - rx_head >= rx_depth) rx_dropped++;
+        else {
+            Queued q;
+            q.time_ns = now_ns;
+            q.msg = msg;
+            rx_queue.push_back(q);
+        }
+    }
+    for (size_t i = 0; i < ecus.size(); i++) {
+        if ((int)i != _sender) ecus[i]->receive(msg, now_ns);
+    }
+}
+uint32_t GMLAN_VirtualBus::advance(uint32_t _us) {
+    uint64_t target = now_ns + (uint64_t)_us * 1000;
+    uint32_t carried = 0;
+    
+    while (now_ns < target) {
+        generateBroadcast();
+        
+        // Arbitrate between every frame that is ready, noting when the next one will be
+        int winner = -3;
+        uint32_t best_key = 0;
+        const CANMessage *best = NULL;
+        uint64_t earliest = (broadcast_load > 0.0f) ? broadcast_next_ns : target;
+        
+        // The tester's frames are all ready once written, its queue gives the one it would send first
+        if (!tx_queue.empty()) {
+            winner = -1;
+            best = tx_queue.peek();
+            best_key = GMLAN_TXQueue::arbitrationKey(*best);
+        }
+        for (size_t i = 0; i < ecus.size(); i++) {
+            const CANMessage *msg;
+            uint64_t ready;
+            if (!ecus[i]->peek(msg, ready)) continue;
+            if (ready > now_ns) {
+                if (ready < earliest) earliest = ready;
+                continue;
+            }
+            uint32_t key = GMLAN_TXQueue::arbitrationKey(*msg);
+            if ((best == NULL) || (key < best_key)) {
+                winner = i;
+                best = msg;
+                best_key = key;
+            }
+        }
+        if (broadcast_head < broadcast_queue.size()) {
+            uint32_t key = GMLAN_TXQueue::arbitrationKey(broadcast_queue[broadcast_head]);
+            if ((best == NULL) || (key < best_key)) {
+                winner = -2;
+                best = &broadcast_queue[broadcast_head];
+                best_key = key;
+            }
+        }
+        
+        if (best == NULL) {
+            // Idle until something becomes ready
+            now_ns = (earliest < target) ? earliest : target;
+            continue;
+        }
+        
+        CANMessage msg = *best;
+        uint64_t duration = GMLAN_TXQueue::frameTime(msg, baud);
+        now_ns += duration;
+        busy_ns += duration;
+        carried++;
+        frames_carried++;
+        
+        if (winner == -1) tx_queue.pop(msg, now_ns / 1000);
+        else if (winner == -2) {
+            broadcast_head++;
+            compact(broadcast_queue, broadcast_head);
+        } else ecus[winner]->sent(now_ns);
+        deliver(msg, winner);
+    }
+    return carried;
+}
+int GMLAN_VirtualBus::read(CANMessage *frames, int _max, uint64_t *timestamps) {
+    int count = 0;
+    while ((count < _max) && (rx_head < rx_queue.size())) {
+        frames[count] = rx_queue[rx_head].msg;
+        if (timestamps != NULL) timestamps[count] = rx_queue[rx_head].time_ns / 1000;
+        rx_head++;
+        count++;
+    }
+    compact(rx_queue, rx_head);
+    return count;
+}
+int GMLAN_VirtualBus::write(const CANMessage *frames, int _count) {
+    int count = 0;
+    while ((count < _count) && ((uint32_t)tx_queue.size() < tx_depth)) tx_queue.push(frames[count++]);
+    return count;
+}
+int GMLAN_VirtualBus::filter(unsigned int id, unsigned int mask, CANFormat format, int handle) {
+    if (handle == 0) filters.clear();
+    Filter f = { id, mask, format };
+    filters.push_back(f);
+    return filters.size();
+}
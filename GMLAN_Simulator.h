@@ -0,0 +1,180 @@
+/*
+GMLAN_Simulator.h - Virtual bus and ECU simulator for GMLAN Library
+
+A deterministic, simulated-time CAN bus with ECUs that answer diagnostic requests
+at the 11-bit IDs in GMLAN_11bit.h and a generator for 29-bit broadcast traffic.
+Lets the request classes be load tested on a host with no vehicle attached: the
+same seed, configuration and calls always give the same frames at the same
+simulated times.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_Transport.h"
+#include "GMLAN_TXQueue.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_SIMULATOR_H
+#define GMLAN_SIMULATOR_H
+
+// Negative response codes the simulated ECUs use
+#define GMLAN_NRC_SERVICE_NOT_SUPPORTED     0x11
+#define GMLAN_NRC_REQUEST_OUT_OF_RANGE      0x31
+#define GMLAN_NRC_RESPONSE_PENDING          0x78
+
+class GMLAN_SimulatedECU {
+    /*
+    Answers physical requests sent to _request_id (GMLAN_TO_BCM...) from
+    _request_id + 0x400 (GMLAN_MF_FROM_BCM...). Requests are matched against the
+    table built with addResponse() / addNegative() by prefix, the longest entry
+    added first wins; anything unmatched gets a negative "service not supported".
+    
+    Segmented requests are flow controlled with setFlowControl()'s BS / STmin and
+    segmented responses wait for the tester's flow control and honour its BS /
+    STmin. setPending() makes the ECU send 0x78 "still processing" responses
+    before each real one. setDropFrame() loses one consecutive frame of the next
+    segmented response, as a receive overrun on the tester's side would.
+    */
+    private:
+        struct Response {
+            vector<char> request, response;
+        };
+        struct Outgoing {
+            uint64_t ready_ns;
+            CANMessage msg;
+        };
+        
+        int request_id, response_id;
+        vector<Response> responses;
+        uint32_t response_delay_ns, pending_count, pending_interval_ns;
+        int rx_block_size, rx_separation;
+        
+        // Segmented request being received
+        vector<char> rx_data;
+        int rx_expected, rx_sequence, rx_block_remaining;
+        // Segmented response being sent
+        vector<char> tx_data;
+        int tx_offset, tx_sequence, tx_block_remaining;
+        int tx_frames, drop_frame;
+        uint64_t tx_separation_ns;
+        bool tx_awaiting_fc;
+        
+        vector<Outgoing> queue;
+        uint32_t requests_seen;
+        
+        void enqueue(uint64_t _ready_ns, const char *_data, int _length);
+        void respond(uint64_t _now_ns);
+        void queueConsecutive(uint64_t _ready_ns);
+    
+    public:
+        // Main function
+        GMLAN_SimulatedECU(int _request_id);
+        
+        // Reply _response to any request starting with _request
+        void addResponse(const vector<char> &_request, const vector<char> &_response);
+        // Reply 7F <sid> _nrc to any request starting with _request
+        void addNegative(const vector<char> &_request, int _nrc);
+        // Time from a complete request to the first reply frame, default 1ms
+        void setResponseDelay(uint32_t _us) { response_delay_ns = _us * 1000; }
+        // _count 0x78 responses _interval_us apart before each real response
+        void setPending(int _count, uint32_t _interval_us) { pending_count = _count; pending_interval_ns = _interval_us * 1000; }
+        // Flow control advertised for segmented requests, raw ISO 15765 STmin
+        void setFlowControl(int _block_size, int _separation_time) { rx_block_size = _block_size & 0xFF; rx_separation = _separation_time & 0xFF; }
+        // Never send the _frame'th consecutive frame (from 1) of the next segmented response
+        void setDropFrame(int _frame) { drop_frame = _frame; }
+        
+        int getRequestID(void) { return request_id; }
+        int getResponseID(void) { return response_id; }
+        uint32_t getRequestCount(void) { return requests_seen; }
+        
+        // Bus side: a frame seen on the bus, the next frame to send (false if none)
+        // and notification that it went out
+        void receive(const CANMessage &msg, uint64_t _now_ns);
+        bool peek(const CANMessage *&msg, uint64_t &_ready_ns);
+        void sent(uint64_t _now_ns);
+};
+
+class GMLAN_VirtualBus : public GMLAN_Transport {
+    /*
+    The bus carries one frame at a time. Whenever it goes idle the lowest
+    identifier among the frames ready to go wins arbitration, standard frames
+    beating extended ones with the same base ID, exactly as on the wire. Each
+    frame occupies the bus for its bit-stuffed length at the configured baud rate.
+    
+    The transport side is the tester: write() queues frames for transmission in a
+    GMLAN_TXQueue (up to _tx_depth, beyond that write() accepts fewer), read() takes delivered frames
+    (up to _rx_depth wait, frames arriving to a full queue are dropped and counted).
+    Time only moves in advance(), pass now() as the time to the request classes:
+    
+        GMLAN_VirtualBus bus;
+        GMLAN_SimulatedECU bcm(GMLAN_TO_BCM);
+        bus.attach(bcm);
+        bus.setBroadcastLoad(1.0);
+        while (bus.service(req, bus.now()) < GMLAN_STATE_COMPLETED) bus.advance(100);
+    
+    setBroadcastLoad() adds 29-bit broadcast frames generated at the given fraction
+    of the bus capacity. What arbitration doesn't leave room for backs up and is
+    dropped once 32 frames are waiting, as a real ECU would overwrite its mailbox.
+    */
+    private:
+        struct Filter {
+            uint32_t id, mask;
+            CANFormat format;
+        };
+        struct Queued {
+            uint64_t time_ns;
+            CANMessage msg;
+        };
+        
+        uint32_t baud;
+        uint64_t now_ns, busy_ns;
+        vector<GMLAN_SimulatedECU *> ecus;
+        
+        GMLAN_TXQueue tx_queue;
+        vector<Queued> rx_queue;
+        size_t rx_head;
+        uint32_t tx_depth, rx_depth;
+        vector<Filter> filters;
+        
+        float broadcast_load;
+        uint32_t broadcast_seed;
+        uint64_t broadcast_next_ns;
+        vector<CANMessage> broadcast_queue;
+        size_t broadcast_head;
+        
+        uint32_t frames_carried, rx_dropped, broadcast_dropped;
+        
+        void generateBroadcast(void);
+        void deliver(const CANMessage &msg, int _sender);
+        bool accepts(const CANMessage &msg);
+    
+    public:
+        // Main function
+        GMLAN_VirtualBus(uint32_t _baud = GMLAN_BAUD_HS, uint32_t _rx_depth = 256, uint32_t _tx_depth = 64);
+        
+        // ECUs are not owned and must outlive the bus
+        void attach(GMLAN_SimulatedECU &ecu) { ecus.push_back(&ecu); }
+        // Fraction of the bus capacity (0.0 - 1.0) to fill with broadcasts, from a seeded generator
+        void setBroadcastLoad(float _load, uint32_t _seed = 1);
+        
+        // Run the simulation forward _us microseconds, returns the frames carried
+        uint32_t advance(uint32_t _us);
+        // Simulated time in microseconds, for the request classes' now_us
+        uint32_t now(void) { return now_ns / 1000; }
+        
+        virtual int read(CANMessage *frames, int _max, uint64_t *timestamps = NULL);
+        virtual int write(const CANMessage *frames, int _count);
+        virtual int filter(unsigned int id, unsigned int mask, CANFormat format = CANAny, int handle = 0);
+        using GMLAN_Transport::read;
+        using GMLAN_Transport::write;
+        
+        uint32_t getFramesCarried(void) { return frames_carried; }
+        // Frames lost to a full tester receive queue / a backed up broadcast generator
+        uint32_t getRXDropped(void) { return rx_dropped; }
+        uint32_t getBroadcastDropped(void) { return broadcast_dropped; }
+        // Fraction of the elapsed time the bus was carrying a frame
+        float getBusLoad(void) { return now_ns ? (float)busy_ns / now_ns : 0.0f; }
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+GMLAN_SocketCAN.cpp - Linux SocketCAN transport for GMLAN Library
+
+Batched raw CAN socket I/O with kernel filtering and receive timestamps.
+*/
+
+#include "mbed.h"
+#include "GMLAN_SocketCAN.h"
+
+#if defined(__linux__)
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+// Frames moved per system call
+#define GMLAN_SOCKETCAN_BATCH 32
+
+static void toFrame(const CANMessage &msg, struct can_frame &frame) {
+    memset(&frame, 0, sizeof(frame));
+    if (msg.format == CANExtended) frame.can_id = (msg.id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    else frame.can_id = msg.id & CAN_SFF_MASK;
+    if (msg.type == CANRemote) frame.can_id |= CAN_RTR_FLAG;
+    frame.can_dlc = (msg.len > 8) ? 8 : msg.len;
+    memcpy(frame.data, msg.data, frame.can_dlc);
+}
+static void fromFrame(const struct can_frame &frame, CANMessage &msg) {
+    if (frame.can_id & CAN_EFF_FLAG) {
+        msg.id = frame.can_id & CAN_EFF_MASK;
+        msg.format = CANExtended;
+    } else {
+        msg.id = frame.can_id & CAN_SFF_MASK;
+        msg.format = CANStandard;
+    }
+    msg.type = (frame.can_id & CAN_RTR_FLAG) ? CANRemote : CANData;
+    msg.len = (frame.can_dlc > 8) ? 8 : frame.can_dlc;
+    memcpy(msg.data, frame.data, msg.len);
+}
+
+bool GMLAN_SocketCAN::open(const char *_interface) {
+    close();
+    fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (fd < 0) return false;
+    
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _interface, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+        close();
+        return false;
+    }
+    
+    // Ask for hardware timestamps with software as the fallback, not every driver has both
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    }
+    
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close();
+        return false;
+    }
+    if (!filters.empty()) applyFilters(filters);
+    return true;
+}
+void GMLAN_SocketCAN::close(void) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+bool GMLAN_SocketCAN::wait(int _timeout_ms) {
+    if (fd < 0) return false;
+    struct pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return (poll(&p, 1, _timeout_ms) > 0) && (p.revents & POLLIN);
+}
+
+int GMLAN_SocketCAN::read(CANMessage *frames, int _max, uint64_t *timestamps) {
+    if (fd < 0) return 0;
+    struct can_frame raw [GMLAN_SOCKETCAN_BATCH];
+    struct iovec iov [GMLAN_SOCKETCAN_BATCH];
+    struct mmsghdr hdr [GMLAN_SOCKETCAN_BATCH];
+    // Room for SO_TIMESTAMPING's three timespecs per frame
+    char control [GMLAN_SOCKETCAN_BATCH][CMSG_SPACE(3 * sizeof(struct timespec))];
+    
+    int total = 0;
+    while (total < _max) {
+        int batch = _max - total;
+        if (batch > GMLAN_SOCKETCAN_BATCH) batch = GMLAN_SOCKETCAN_BATCH;
+        for (int i = 0; i < batch; i++) {
+            iov[i].iov_base = &raw[i];
+            iov[i].iov_len = sizeof(raw[i]);
+            memset(&hdr[i], 0, sizeof(hdr[i]));
+            hdr[i].msg_hdr.msg_iov = &iov[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+            hdr[i].msg_hdr.msg_control = control[i];
+            hdr[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        int got = recvmmsg(fd, hdr, batch, MSG_DONTWAIT, NULL);
+        if (got <= 0) break;
+        
+        for (int i = 0; i < got; i++) {
+            fromFrame(raw[i], frames[total + i]);
+            if (timestamps == NULL) continue;
+            uint64_t stamp = 0;
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(&hdr[i].msg_hdr); c != NULL; c = CMSG_NXTHDR(&hdr[i].msg_hdr, c)) {
+                if (c->cmsg_level != SOL_SOCKET) continue;
+                if (c->cmsg_type == SO_TIMESTAMPING) {
+                    // [0] software, [2] raw hardware
+                    const struct timespec *ts = (const struct timespec *)CMSG_DATA(c);
+                    const struct timespec *pick = &ts[0];
+                    if (ts[2].tv_sec || ts[2].tv_nsec) {
+                        pick = &ts[2];
+                        hardware_timestamps = true;
+                    }
+                    stamp = (uint64_t)pick->tv_sec * 1000000 + pick->tv_nsec / 1000;
+                } else if (c->cmsg_type == SO_TIMESTAMPNS) {
+                    const struct timespec *ts = (const struct timespec *)CMSG_DATA(c);
+                    stamp = (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+                }
+            }
+            timestamps[total + i] = stamp;
+        }
+        total += got;
+        if (got < batch) break;
+    }
+    return total;
+}
+int GMLAN_SocketCAN::write(const CANMessage *frames, int _count) {
+    if (fd < 0) return 0;
+    struct can_frame raw [GMLAN_SOCKETCAN_BATCH];
+    struct iovec iov [GMLAN_SOCKETCAN_BATCH];
+    struct mmsghdr hdr [GMLAN_SOCKETCAN_BATCH];
+    
+    int total = 0;
+    while (total < _count) {
+        int batch = _count - total;
+        if (batch > GMLAN_SOCKETCAN_BATCH) batch = GMLAN_SOCKETCAN_BATCH;
+        for (int i = 0; i < batch; i++) {
+            toFrame(frames[total + i], raw[i]);
+            iov[i].iov_base = &raw[i];
+            iov[i].iov_len = sizeof(raw[i]);
+            memset(&hdr[i], 0, sizeof(hdr[i]));
+            hdr[i].msg_hdr.msg_iov = &iov[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+        }
+        // A full transmit queue (ENOBUFS / EAGAIN) ends the batch early, the caller retries the rest
+        int sent = sendmmsg(fd, hdr, batch, MSG_DONTWAIT);
+        if (sent <= 0) break;
+        total += sent;
+        if (sent < batch) break;
+    }
+    return total;
+}
+
+int GMLAN_SocketCAN::filter(unsigned int id, unsigned int mask, CANFormat format, int handle) {
+    Filter f;
+    if (format == CANExtended) {
+        f.id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        f.mask = (mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    } else if (format == CANStandard) {
+        f.id = id & CAN_SFF_MASK;
+        f.mask = (mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+    } else {
+        f.id = id;
+        f.mask = mask;
+    }
+    // Only replace the list once the kernel has taken it, so the two never disagree
+    vector<Filter> updated;
+    if (handle != 0) updated = filters;
+    updated.push_back(f);
+    if ((fd >= 0) && !applyFilters(updated)) return 0;
+    filters.swap(updated);
+    return filters.size();
+}
+bool GMLAN_SocketCAN::applyFilters(const vector<Filter> &_filters) {
+    // Filter shares struct can_filter's layout, hand the vector over as is
+    static_assert(sizeof(Filter) == sizeof(struct can_filter), "Filter must match struct can_filter");
+    return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, &_filters[0], _filters.size() * sizeof(struct can_filter)) == 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+GMLAN_SocketCAN.h - Linux SocketCAN transport for GMLAN Library
+
+Runs the library on a Linux host against a real or virtual CAN interface
+(can0, vcan0...). Frames are moved with recvmmsg() / sendmmsg() so a busy bus
+costs one system call per batch rather than per frame, receive filtering is done
+in the kernel with CAN_RAW_FILTER and every received frame carries the kernel's
+timestamp (the controller's own when the driver supports hardware timestamping).
+*/
+
+#include "mbed.h"
+#include "GMLAN_Transport.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_SOCKETCAN_H
+#define GMLAN_SOCKETCAN_H
+
+#if defined(__linux__)
+
+class GMLAN_SocketCAN : public GMLAN_Transport {
+    /*
+    Example, letting the planner turn subscriptions into kernel filters:
+    
+        GMLAN_SocketCAN bus;
+        bus.open("can0");
+        GMLAN_11Bit_Request read_vin(GMLAN_TO_BCM, vin_request);
+        GMLAN_FilterPlanner planner;
+        planner.addRequest(read_vin);
+        planner.plan(16, 16);
+        planner.apply(bus);
+    
+    Reads never block, use wait() to sleep until something arrives.
+    */
+    private:
+        int fd;
+        bool hardware_timestamps;
+        // Kept in struct can_filter layout, so no kernel headers leak in here
+        struct Filter {
+            uint32_t id, mask;
+        };
+        vector<Filter> filters;
+        
+        bool applyFilters(const vector<Filter> &_filters);
+    
+    public:
+        // Main function
+        GMLAN_SocketCAN() : fd(-1), hardware_timestamps(false) { }
+        ~GMLAN_SocketCAN() { close(); }
+        
+        // Bind to an interface by name, returns false if it does not exist or the socket fails
+        bool open(const char *_interface);
+        void close(void);
+        bool isOpen(void) { return fd >= 0; }
+        int getDescriptor(void) { return fd; }
+        // True once a received frame came with a hardware timestamp
+        bool hasHardwareTimestamps(void) { return hardware_timestamps; }
+        
+        virtual bool wait(int _timeout_ms);
+        virtual int read(CANMessage *frames, int _max, uint64_t *timestamps = NULL);
+        virtual int write(const CANMessage *frames, int _count);
+        virtual int filter(unsigned int id, unsigned int mask, CANFormat format = CANAny, int handle = 0);
+        using GMLAN_Transport::read;
+        using GMLAN_Transport::write;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,139 @@
+/*
+GMLAN_TXQueue.cpp - Priority transmit queue and bus load accounting for GMLAN Library
+
+Heap ordering, bit-stuffed frame timing and the utilisation window.
+*/
+
+#include "mbed.h"
+#include "GMLAN_TXQueue.h"
+#include <algorithm>
+
+// Heap comparison, the smallest order sits on top
+static bool laterEntry(const uint64_t &a, const uint64_t &b) { return a > b; }
+
+GMLAN_TXQueue::GMLAN_TXQueue(uint32_t _baud, int _capacity, uint32_t _window_us) {
+    baud = _baud;
+    capacity = _capacity;
+    heap.reserve(_capacity);
+    sequence = 0;
+    limit_priority = 8;
+    limit_load = 1.0f;
+    window_us = (_window_us == 0) ? 1 : _window_us;
+    window_start = 0;
+    window_busy_ns = previous_busy_ns = 0;
+    held = dropped = 0;
+}
+uint32_t GMLAN_TXQueue::arbitrationKey(const CANMessage &msg) {
+    uint32_t remote = (msg.type == CANRemote) ? 1 : 0;
+    if (msg.format != CANExtended) return ((msg.id & 0x7FF) << 21) | (remote << 20);
+    return (((msg.id >> 18) & 0x7FF) << 21) | (1 << 20) | (1 << 19) | ((msg.id & 0x3FFFF) << 1) | remote;
+}
+
+// Feeds the frame one bit at a time, counting stuff bits and building the CRC
+struct GMLAN_BitStream {
+    uint32_t bits;
+    uint16_t crc;
+    int last, run;
+    
+    GMLAN_BitStream() : bits(0), crc(0), last(-1), run(0) { }
+    void stuff(int _bit) {
+        bits++;
+        if (_bit == last) run++;
+        else {
+            last = _bit;
+            run = 1;
+        }
+        if (run == 5) {
+            // Five equal bits in a row, the transmitter inserts the complement
+            bits++;
+            last = !_bit;
+            run = 1;
+        }
+    }
+    void add(uint32_t _value, int _width) {
+        for (int i = _width - 1; i >= 0; i--) {
+            int bit = (_value >> i) & 1;
+            // CAN CRC-15, x^15 + x^14 + x^10 + x^8 + x^7 + x^4 + x^3 + 1
+            int next = bit ^ ((crc >> 14) & 1);
+            crc = (crc << 1) & 0x7FFF;
+            if (next) crc ^= 0x4599;
+            stuff(bit);
+        }
+    }
+};
+
+uint32_t GMLAN_TXQueue::stuffedBits(const CANMessage &msg) {
+    GMLAN_BitStream stream;
+    int length = (msg.len > 8) ? 8 : msg.len;
+    int remote = (msg.type == CANRemote) ? 1 : 0;
+    
+    stream.add(0, 1);                                       // SOF
+    if (msg.format == CANExtended) {
+        stream.add((msg.id >> 18) & 0x7FF, 11);
+        stream.add(0x3, 2);                                 // SRR, IDE
+        stream.add(msg.id & 0x3FFFF, 18);
+        stream.add(remote, 1);
+        stream.add(0, 2);                                   // r1, r0
+    } else {
+        stream.add(msg.id & 0x7FF, 11);
+        stream.add(remote, 1);
+        stream.add(0, 2);                                   // IDE, r0
+    }
+    stream.add(length, 4);
+    if (!remote) {
+        for (int i = 0; i < length; i++) stream.add((unsigned char)msg.data[i], 8);
+    }
+    // The CRC sequence is stuffed too, but isn't part of its own calculation
+    uint16_t crc = stream.crc;
+    for (int i = 14; i >= 0; i--) stream.stuff((crc >> i) & 1);
+    
+    // CRC delimiter, ACK slot and delimiter, EOF, interframe space
+    return stream.bits + 1 + 2 + 7 + 3;
+}
+
+bool GMLAN_TXQueue::push(const CANMessage &msg) {
+    if ((int)heap.size() >= capacity) {
+        dropped++;
+        return false;
+    }
+    Entry e;
+    e.order = ((uint64_t)arbitrationKey(msg) << 32) | sequence++;
+    e.msg = msg;
+    e.bits = stuffedBits(msg);
+    heap.push_back(e);
+    std::push_heap(heap.begin(), heap.end(), [](const Entry &a, const Entry &b) { return laterEntry(a.order, b.order); });
+    return true;
+}
+bool GMLAN_TXQueue::pop(CANMessage &msg, uint32_t _now_us) {
+    if (heap.empty()) return false;
+    // Anything below the head in the heap is no higher priority, so one check covers the lot
+    if ((priorityOf(heap[0].msg) >= limit_priority) && (getUtilisation(_now_us) > limit_load)) {
+        held++;
+        return false;
+    }
+    std::pop_heap(heap.begin(), heap.end(), [](const Entry &a, const Entry &b) { return laterEntry(a.order, b.order); });
+    msg = heap.back().msg;
+    account(heap.back().bits, _now_us);
+    heap.pop_back();
+    return true;
+}
+
+void GMLAN_TXQueue::roll(uint32_t _now_us) {
+    uint32_t elapsed = _now_us - window_start;
+    if (elapsed < window_us) return;
+    // One window on, the current becomes the previous; further and both are idle
+    previous_busy_ns = (elapsed < 2 * window_us) ? window_busy_ns : 0;
+    window_busy_ns = 0;
+    window_start += (elapsed / window_us) * window_us;
+}
+void GMLAN_TXQueue::account(uint32_t _bits, uint32_t _now_us) {
+    roll(_now_us);
+    window_busy_ns += (uint64_t)_bits * 1000000000ULL / baud;
+}
+float GMLAN_TXQueue::getUtilisation(uint32_t _now_us) {
+    roll(_now_us);
+    // Slide across the window boundary by weighting the previous window by how much of it still counts
+    float through = (float)(_now_us - window_start) / window_us;
+    float busy = previous_busy_ns * (1.0f - through) + window_busy_ns;
+    return busy / (window_us * 1000.0f);
+}
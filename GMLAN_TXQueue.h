@@ -0,0 +1,95 @@
+/*
+GMLAN_TXQueue.h - Priority transmit queue and bus load accounting for GMLAN Library
+
+Holds frames waiting for the bus in the order arbitration would let them out
+(3-bit priority first, then arbitration ID) instead of the order they were
+queued, so a burst of text display frames can't hold up time critical ones.
+Also works out exact bit-stuffed frame times at each GMLAN baud rate to keep
+a live bus utilisation figure and throttle low priority traffic with it.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_TXQUEUE_H
+#define GMLAN_TXQUEUE_H
+
+class GMLAN_TXQueue {
+    /*
+    A binary heap on arbitrationKey(), frames with the same identifier leave in
+    the order queued so segmented transfers stay in sequence. The first three
+    identifier bits on the wire are the CANHeader priority for 29-bit frames and
+    the top of the ID for 11-bit ones, priorityOf() gives that field for both.
+    
+    Utilisation is the time the bus spent carrying frames over a sliding window,
+    counting frames popped from here plus anything passed to observe() (frames
+    received from other nodes). With setRateLimit(5, 0.7) frames of priority 5-7
+    are held back while utilisation is over 70%, higher priority ones always go.
+    
+    Example:
+    
+        GMLAN_TXQueue tx(GMLAN_BAUD_LS_NORMAL);
+        tx.setRateLimit(6, 0.6f);
+        tx.push(GMLAN_Message(0x6, GMLAN_ARBID_ARB_TEXT_REQ_SET_DISPLAY_TEXT, 0x60, 0x01, 'H', 'i').generate());
+        
+        CANMessage msg;
+        while (tx.pop(msg, us_ticker_read())) can.write(msg);
+    */
+    private:
+        struct Entry {
+            uint64_t order;     // arbitration key then sequence number
+            CANMessage msg;
+            uint32_t bits;
+        };
+        
+        vector<Entry> heap;
+        int capacity;
+        uint32_t baud, sequence;
+        int limit_priority;
+        float limit_load;
+        uint32_t window_us, window_start;
+        uint64_t window_busy_ns, previous_busy_ns;
+        uint32_t held, dropped;
+        
+        void account(uint32_t _bits, uint32_t _now_us);
+        void roll(uint32_t _now_us);
+    
+    public:
+        // Main function, _window_us is the span utilisation is measured over
+        GMLAN_TXQueue(uint32_t _baud = GMLAN_BAUD_HS, int _capacity = 64, uint32_t _window_us = 100000);
+        
+        // Queue a frame, false if the queue is full
+        bool push(const CANMessage &msg);
+        // Take the frame that would win arbitration if it may go now, false if the queue is
+        // empty or the rate limit is holding everything left
+        bool pop(CANMessage &msg, uint32_t _now_us);
+        // Look at the next frame without taking it or applying the rate limit
+        const CANMessage *peek(void) { return heap.empty() ? NULL : &heap[0].msg; }
+        // Count a frame another node put on the bus towards utilisation
+        void observe(const CANMessage &msg, uint32_t _now_us) { account(stuffedBits(msg), _now_us); }
+        
+        // Hold frames of _priority (0-7) and numerically higher while utilisation exceeds _max_load (0.0 - 1.0)
+        void setRateLimit(int _priority, float _max_load) { limit_priority = _priority; limit_load = _max_load; }
+        void clearRateLimit(void) { limit_priority = 8; }
+        
+        // Fraction of the last window the bus was busy
+        float getUtilisation(uint32_t _now_us);
+        int size(void) { return heap.size(); }
+        bool empty(void) { return heap.empty(); }
+        // Pops refused by the rate limit, pushes refused by a full queue
+        uint32_t getHeld(void) { return held; }
+        uint32_t getDropped(void) { return dropped; }
+        
+        // Ordering used on the wire, lower wins: base ID, RTR / SRR, IDE, extended ID, RTR
+        static uint32_t arbitrationKey(const CANMessage &msg);
+        static int priorityOf(const CANMessage &msg) { return arbitrationKey(msg) >> 29; }
+        // Bits on the wire including stuff bits, the CRC worked out from the actual frame, and
+        // the 3 bit interframe space
+        static uint32_t stuffedBits(const CANMessage &msg);
+        // stuffedBits() at _baud (GMLAN_BAUD_LS_NORMAL, LS_FAST, MS or HS) in nanoseconds
+        static uint32_t frameTime(const CANMessage &msg, uint32_t _baud) { return (uint64_t)stuffedBits(msg) * 1000000000ULL / _baud; }
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+GMLAN_Trace.cpp - Binary CAN trace capture and replay for GMLAN Library
+
+Fixed size records, a per arbitration ID index built on open and a replay
+engine that drives the library's receive paths from a capture.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GMLAN_TRACE_MMAP 1
+#endif
+
+// One index key per 29-bit arbitration ID, then one per 11-bit identifier
+#define GMLAN_TRACE_KEYS (0x2000 + 0x800)
+
+bool GMLAN_TraceWriter::open(const char *_path, uint64_t _start_time_us) {
+    close();
+    file = fopen(_path, "wb");
+    if (file == NULL) return false;
+    
+    GMLAN_TraceHeader hdr;
+    memcpy(hdr.magic, "GMLT", 4);
+    hdr.version = GMLAN_TRACE_VERSION;
+    hdr.record_size = sizeof(GMLAN_TraceRecord);
+    hdr.start_time_us = _start_time_us;
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
+        close();
+        return false;
+    }
+    written = 0;
+    return true;
+}
+void GMLAN_TraceWriter::close(void) {
+    if (file != NULL) fclose(file);
+    file = NULL;
+}
+bool GMLAN_TraceWriter::write(const CANMessage &msg, uint64_t _timestamp_us) {
+    if (file == NULL) return false;
+    GMLAN_TraceRecord rec;
+    rec.timestamp_us = _timestamp_us;
+    rec.id = msg.id;
+    rec.dlc = (msg.len > 8) ? 8 : msg.len;
+    rec.flags = ((msg.format == CANExtended) ? GMLAN_TRACE_EXTENDED : 0) | ((msg.type == CANRemote) ? GMLAN_TRACE_REMOTE : 0);
+    rec.reserved = 0;
+    memcpy(rec.data, msg.data, 8);
+    if (fwrite(&rec, sizeof(rec), 1, file) != 1) return false;
+    written++;
+    return true;
+}
+
+GMLAN_TraceReader::GMLAN_TraceReader() {
+    base = NULL;
+    mapped_size = 0;
+    header = NULL;
+    records = NULL;
+    record_count = 0;
+}
+bool GMLAN_TraceReader::open(const char *_path) {
+    close();
+#ifdef GMLAN_TRACE_MMAP
+    int fd = ::open(_path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(GMLAN_TraceHeader))) {
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+    // Replay walks the records front to back
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    base = (const uint8_t *)map;
+    mapped_size = st.st_size;
+#else
+    FILE *file = fopen(_path, "rb");
+    if (file == NULL) return false;
+    uint8_t chunk [512];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) loaded.insert(loaded.end(), chunk, chunk + got);
+    fclose(file);
+    if (loaded.size() < sizeof(GMLAN_TraceHeader)) {
+        loaded.clear();
+        return false;
+    }
+    base = &loaded[0];
+    mapped_size = loaded.size();
+#endif
+    
+    header = (const GMLAN_TraceHeader *)base;
+    if ((memcmp(header->magic, "GMLT", 4) != 0) || (header->version != GMLAN_TRACE_VERSION) ||
+        (header->record_size != sizeof(GMLAN_TraceRecord))) {
+        close();
+        return false;
+    }
+    records = (const GMLAN_TraceRecord *)(base + sizeof(GMLAN_TraceHeader));
+    // A partly written last record (capture cut off) is ignored
+    record_count = (mapped_size - sizeof(GMLAN_TraceHeader)) / sizeof(GMLAN_TraceRecord);
+    buildIndex();
+    return true;
+}
+void GMLAN_TraceReader::close(void) {
+#ifdef GMLAN_TRACE_MMAP
+    if ((base != NULL) && loaded.empty()) munmap((void *)base, mapped_size);
+#endif
+    loaded.clear();
+    base = NULL;
+    mapped_size = 0;
+    header = NULL;
+    records = NULL;
+    record_count = 0;
+    index_offsets.clear();
+    index_records.clear();
+}
+int GMLAN_TraceReader::key(const GMLAN_TraceRecord &_record) {
+    if (_record.flags & GMLAN_TRACE_EXTENDED) {
+        CANHeader hdr;
+        hdr.decode(_record.id);
+        return hdr.arbitration();
+    }
+    return 0x2000 + (_record.id & 0x7FF);
+}
+void GMLAN_TraceReader::buildIndex(void) {
+    // Counting sort: size each key's bucket, prefix sum, then drop record numbers in
+    index_offsets.assign(GMLAN_TRACE_KEYS + 1, 0);
+    for (uint32_t i = 0; i < record_count; i++) index_offsets[key(records[i]) + 1]++;
+    for (int k = 0; k < GMLAN_TRACE_KEYS; k++) index_offsets[k + 1] += index_offsets[k];
+    
+    index_records.resize(record_count);
+    vector<uint32_t> fill(index_offsets.begin(), index_offsets.end() - 1);
+    for (uint32_t i = 0; i < record_count; i++) index_records[fill[key(records[i])]++] = i;
+}
+const uint32_t *GMLAN_TraceReader::find(int _arbitration, bool _extended, uint32_t &_count) const {
+    _count = 0;
+    if (index_offsets.empty()) return NULL;
+    int k = _extended ? (_arbitration & 0x1FFF) : (0x2000 + (_arbitration & 0x7FF));
+    _count = index_offsets[k + 1] - index_offsets[k];
+    return (_count == 0) ? NULL : &index_records[index_offsets[k]];
+}
+CANMessage GMLAN_TraceReader::toMessage(const GMLAN_TraceRecord &_record) {
+    CANMessage msg;
+    msg.id = _record.id;
+    msg.len = (_record.dlc > 8) ? 8 : _record.dlc;
+    msg.format = (_record.flags & GMLAN_TRACE_EXTENDED) ? CANExtended : CANStandard;
+    msg.type = (_record.flags & GMLAN_TRACE_REMOTE) ? CANRemote : CANData;
+    memcpy(msg.data, _record.data, 8);
+    return msg;
+}
+
+GMLAN_TraceReplay::GMLAN_TraceReplay(const GMLAN_TraceReader &_reader) : reader(_reader) {
+    dispatcher = NULL;
+    sessions = NULL;
+    callback = NULL;
+    callback_context = NULL;
+}
+void GMLAN_TraceReplay::deliver(const GMLAN_TraceRecord &_record) {
+    CANMessage msg = GMLAN_TraceReader::toMessage(_record);
+    if (dispatcher != NULL) dispatcher->dispatch(msg);
+    if (msg.format == CANStandard) {
+        // Diagnostic traffic is 11-bit only
+        if (sessions != NULL) sessions->processFrame(msg);
+        for (size_t r = 0; r < requests.size(); r++) requests[r]->processFrame(msg);
+    }
+    if (callback != NULL) callback(msg, _record.timestamp_us, callback_context);
+}
+
+// Paces replay against a 64-bit elapsed clock built from the wrapping microsecond ticker
+class GMLAN_ReplayClock {
+    private:
+        uint32_t last;
+        uint64_t elapsed;
+    public:
+        GMLAN_ReplayClock() : last(us_ticker_read()), elapsed(0) { }
+        uint64_t now(void) {
+            uint32_t t = us_ticker_read();
+            elapsed += (uint32_t)(t - last);
+            last = t;
+            return elapsed;
+        }
+        void waitUntil(uint64_t _target) {
+            uint64_t t;
+            while ((t = now()) < _target) {
+                uint64_t gap = _target - t;
+                wait_us((gap > 100000) ? 100000 : (int)gap);
+            }
+        }
+};
+
+uint32_t GMLAN_TraceReplay::run(double _speed, uint32_t _first, uint32_t _last) {
+    if ((_last == 0) || (_last > reader.count())) _last = reader.count();
+    if (_first >= _last) return 0;
+    
+    GMLAN_ReplayClock clock;
+    uint64_t origin = reader.record(_first).timestamp_us;
+    for (uint32_t i = _first; i < _last; i++) {
+        const GMLAN_TraceRecord &rec = reader.record(i);
+        if ((_speed > 0) && (rec.timestamp_us > origin)) clock.waitUntil((uint64_t)((rec.timestamp_us - origin) / _speed));
+        
+        deliver(rec);
+    }
+    return _last - _first;
+}
+uint32_t GMLAN_TraceReplay::runIndexed(int _arbitration, bool _extended, double _speed) {
+    uint32_t count;
+    const uint32_t *index = reader.find(_arbitration, _extended, count);
+    if (index == NULL) return 0;
+    
+    GMLAN_ReplayClock clock;
+    uint64_t origin = reader.record(index[0]).timestamp_us;
+    for (uint32_t i = 0; i < count; i++) {
+        const GMLAN_TraceRecord &rec = reader.record(index[i]);
+        if ((_speed > 0) && (rec.timestamp_us > origin)) clock.waitUntil((uint64_t)((rec.timestamp_us - origin) / _speed));
+        
+        deliver(rec);
+    }
+    return count;
+}
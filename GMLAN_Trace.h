@@ -0,0 +1,152 @@
+/*
+GMLAN_Trace.h - Binary CAN trace capture and replay for GMLAN Library
+
+Traffic is stored as a 16 byte file header followed by fixed size 24 byte
+records, little endian throughout:
+
+    header: "GMLT" | version (u16) | record size (u16) | capture start time, us (u64)
+    record: timestamp, us (u64) | raw ID (u32) | DLC (u8) | flags (u8) | reserved (u16) | data [8]
+
+Fixed records mean a trace can be mapped straight into memory and indexed without
+parsing. The reader builds a per arbitration ID index on open (decoded through
+CANHeader for 29-bit frames) and the replay engine feeds frames back into the
+library's receive paths, paced like the original capture or as fast as possible.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_Dispatcher.h"
+#include "GMLAN_SessionManager.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#ifndef GMLAN_TRACE_H
+#define GMLAN_TRACE_H
+
+#define GMLAN_TRACE_VERSION 1
+
+// Record flags
+#define GMLAN_TRACE_EXTENDED    0x01
+#define GMLAN_TRACE_REMOTE      0x02
+
+struct GMLAN_TraceHeader {
+    char magic [4];
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t start_time_us;
+};
+
+struct GMLAN_TraceRecord {
+    uint64_t timestamp_us;
+    uint32_t id;
+    uint8_t dlc;
+    uint8_t flags;
+    uint16_t reserved;
+    uint8_t data [8];
+};
+
+static_assert(sizeof(GMLAN_TraceHeader) == 16, "GMLAN_TraceHeader must stay 16 bytes on disk");
+static_assert(sizeof(GMLAN_TraceRecord) == 24, "GMLAN_TraceRecord must stay 24 bytes on disk");
+
+class GMLAN_TraceWriter {
+    /*
+    Appends frames to a trace file through stdio, so it works the same on a host
+    or on a target with a mounted filesystem
+    */
+    private:
+        FILE *file;
+        uint32_t written;
+    
+    public:
+        // Main function
+        GMLAN_TraceWriter() : file(NULL), written(0) { }
+        ~GMLAN_TraceWriter() { close(); }
+        
+        // Create (truncate) a trace file, returns false if it can't be opened
+        bool open(const char *_path, uint64_t _start_time_us = 0);
+        void close(void);
+        
+        // Append one frame with its receive timestamp
+        bool write(const CANMessage &msg, uint64_t _timestamp_us);
+        uint32_t count(void) { return written; }
+};
+
+class GMLAN_TraceReader {
+    /*
+    Maps a trace read-only (or loads it where mmap isn't available). Records are
+    used in place, never copied. The index is a compressed table of record
+    numbers grouped by key, one key per 29-bit arbitration ID followed by one per
+    11-bit identifier, so all frames of an ID are found with two loads.
+    */
+    private:
+        const uint8_t *base;
+        size_t mapped_size;
+        vector<uint8_t> loaded;
+        const GMLAN_TraceHeader *header;
+        const GMLAN_TraceRecord *records;
+        uint32_t record_count;
+        vector<uint32_t> index_offsets, index_records;
+        
+        static int key(const GMLAN_TraceRecord &_record);
+        void buildIndex(void);
+    
+    public:
+        // Main function
+        GMLAN_TraceReader();
+        ~GMLAN_TraceReader() { close(); }
+        
+        // Map a trace file and index it, returns false if it is missing or malformed
+        bool open(const char *_path);
+        void close(void);
+        
+        uint32_t count(void) const { return record_count; }
+        uint64_t startTime(void) const { return (header != NULL) ? header->start_time_us : 0; }
+        const GMLAN_TraceRecord &record(uint32_t _index) const { return records[_index]; }
+        
+        // Record numbers of every frame with an arbitration ID (29-bit) or identifier (11-bit),
+        // in capture order. Returns NULL with _count 0 when there are none
+        const uint32_t *find(int _arbitration, bool _extended, uint32_t &_count) const;
+        
+        // Rebuild a CANMessage from a record
+        static CANMessage toMessage(const GMLAN_TraceRecord &_record);
+};
+
+// Called for every replayed frame, with its original capture timestamp
+typedef void (*GMLAN_ReplayCallback)(const CANMessage &msg, uint64_t timestamp_us, void *context);
+
+class GMLAN_TraceReplay {
+    /*
+    Feeds a trace back through the receive paths: a GMLAN_Dispatcher for broadcast
+    handlers, a GMLAN_SessionManager and any number of GMLAN_11Bit_Request state
+    machines. A speed of 1.0 reproduces the capture timing, 10.0 runs ten times
+    faster and 0 replays as fast as the handlers allow.
+    */
+    private:
+        const GMLAN_TraceReader &reader;
+        GMLAN_Dispatcher *dispatcher;
+        GMLAN_SessionManager *sessions;
+        vector<GMLAN_11Bit_Request *> requests;
+        GMLAN_ReplayCallback callback;
+        void *callback_context;
+        
+        void deliver(const GMLAN_TraceRecord &_record);
+    
+    public:
+        // Main function
+        GMLAN_TraceReplay(const GMLAN_TraceReader &_reader);
+        
+        // Where replayed frames go, any combination may be set
+        void setDispatcher(GMLAN_Dispatcher *_dispatcher) { dispatcher = _dispatcher; }
+        void setSessionManager(GMLAN_SessionManager *_sessions) { sessions = _sessions; }
+        void addRequest(GMLAN_11Bit_Request *_request) { requests.push_back(_request); }
+        void setCallback(GMLAN_ReplayCallback _callback, void *_context = NULL) { callback = _callback; callback_context = _context; }
+        
+        // Replay records [_first, _last), _last of 0 meaning the end of the trace.
+        // Returns the number of frames replayed
+        uint32_t run(double _speed = 0, uint32_t _first = 0, uint32_t _last = 0);
+        // Replay only the frames of one ID using the reader's index
+        uint32_t runIndexed(int _arbitration, bool _extended, double _speed = 0);
+};
+
+#endif
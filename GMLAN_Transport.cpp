@@ -0,0 +1,134 @@
+/*
+GMLAN_Transport.cpp - CAN transport abstraction for GMLAN Library
+
+Request servicing shared by every backend, and the in-process loopback.
+*/
+
+#include "mbed.h"
+#include "GMLAN_Transport.h"
+
+// Frames moved per batch when servicing a request
+#define GMLAN_TRANSPORT_BATCH 16
+
+void GMLAN_Transport::transmit(const CANMessage *frames, int _count) {
+    if (!tx_backlog.empty()) {
+        int sent = write(&tx_backlog[0], tx_backlog.size());
+        if (sent > 0) tx_backlog.erase(tx_backlog.begin(), tx_backlog.begin() + sent);
+        // Keep the order, new frames wait behind what is still queued
+        if (!tx_backlog.empty()) {
+            tx_backlog.insert(tx_backlog.end(), frames, frames + _count);
+            return;
+        }
+    }
+    if (_count <= 0) return;
+    // The request has already moved past these frames, so whatever isn't taken is kept
+    int sent = write(frames, _count);
+    if (sent < 0) sent = 0;
+    tx_backlog.insert(tx_backlog.end(), frames + sent, frames + _count);
+}
+int GMLAN_Transport::service(GMLAN_11Bit_Request &request, uint32_t now_us) {
+    CANMessage frames [GMLAN_TRANSPORT_BATCH];
+    
+    // Frames the backend couldn't take last time go first, nothing new until they're out
+    if (!tx_backlog.empty()) transmit(NULL, 0);
+    if (tx_backlog.empty()) {
+        if (request.getState() == GMLAN_STATE_READY_TO_SEND) request.start();
+        if (request.getState() == GMLAN_STATE_SEND_FC) {
+            CANMessage fc = request.getFlowControl(now_us);
+            transmit(&fc, 1);
+        }
+        if (tx_backlog.empty() && request.frameDue(now_us)) {
+            int count = request.getFrames(frames, GMLAN_TRANSPORT_BATCH, now_us);
+            transmit(frames, count);
+        }
+    }
+    
+    int count;
+    while ((count = read(frames, GMLAN_TRANSPORT_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) request.processFrame(frames[i], now_us);
+    }
+    request.checkTimeout(now_us);
+    return request.getState();
+}
+
+GMLAN_Loopback::~GMLAN_Loopback() {
+    // Make sure no other port keeps delivering to us
+    for (size_t i = 0; i < peers.size(); i++) {
+        vector<GMLAN_Loopback *> &theirs = peers[i]->peers;
+        for (size_t j = 0; j < theirs.size(); j++) {
+            if (theirs[j] == this) {
+                theirs.erase(theirs.begin() + j);
+                break;
+            }
+        }
+    }
+}
+void GMLAN_Loopback::connect(GMLAN_Loopback &peer) {
+    if (&peer == this) return;
+    // Everyone already on either side hears everyone on the other
+    vector<GMLAN_Loopback *> mine(peers), theirs(peer.peers);
+    mine.push_back(this);
+    theirs.push_back(&peer);
+    for (size_t i = 0; i < mine.size(); i++) {
+        for (size_t j = 0; j < theirs.size(); j++) {
+            GMLAN_Loopback *a = mine[i], *b = theirs[j];
+            bool linked = false;
+            for (size_t k = 0; k < a->peers.size() && !linked; k++) linked = (a->peers[k] == b);
+            if (linked || (a == b)) continue;
+            a->peers.push_back(b);
+            b->peers.push_back(a);
+        }
+    }
+}
+bool GMLAN_Loopback::accepts(const CANMessage &msg) {
+    if (filters.empty()) return true;
+    for (size_t i = 0; i < filters.size(); i++) {
+        const Filter &f = filters[i];
+        if ((f.format != CANAny) && (f.format != msg.format)) continue;
+        if (((msg.id ^ f.id) & f.mask) == 0) return true;
+    }
+    return false;
+}
+void GMLAN_Loopback::deliver(const CANMessage &msg, uint64_t _timestamp) {
+    if (!accepts(msg)) return;
+    if (pending() >= depth) {
+        dropped++;
+        return;
+    }
+    // Compact the queue once the consumed part dominates
+    if ((queue_head > 0) && (queue_head >= queue.size() / 2)) {
+        queue.erase(queue.begin(), queue.begin() + queue_head);
+        queue_head = 0;
+    }
+    Queued q;
+    q.msg = msg;
+    q.timestamp = _timestamp;
+    queue.push_back(q);
+}
+int GMLAN_Loopback::read(CANMessage *frames, int _max, uint64_t *timestamps) {
+    int count = 0;
+    while ((count < _max) && (queue_head < queue.size())) {
+        frames[count] = queue[queue_head].msg;
+        if (timestamps != NULL) timestamps[count] = queue[queue_head].timestamp;
+        queue_head++;
+        count++;
+    }
+    if (queue_head == queue.size()) {
+        queue.clear();
+        queue_head = 0;
+    }
+    return count;
+}
+int GMLAN_Loopback::write(const CANMessage *frames, int _count) {
+    uint64_t now = us_ticker_read();
+    for (int i = 0; i < _count; i++) {
+        for (size_t p = 0; p < peers.size(); p++) peers[p]->deliver(frames[i], now);
+    }
+    return _count;
+}
+int GMLAN_Loopback::filter(unsigned int id, unsigned int mask, CANFormat format, int handle) {
+    if (handle == 0) filters.clear();
+    Filter f = { id, mask, format };
+    filters.push_back(f);
+    return filters.size();
+}
@@ -0,0 +1,132 @@
+/*
+GMLAN_Transport.h - CAN transport abstraction for GMLAN Library
+
+Lets the request and message classes run over something other than mbed's CAN
+class: a Linux SocketCAN interface (GMLAN_SocketCAN.h), an in-process loopback
+for testing without hardware, or mbed's CAN peripheral itself.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include <stdint.h>
+#include <vector>
+
+#ifndef GMLAN_TRANSPORT_H
+#define GMLAN_TRANSPORT_H
+
+class GMLAN_Transport {
+    /*
+    Backends move frames in batches, a backend that can only do one at a time
+    just returns 1. Timestamps are microseconds from whatever clock the backend
+    has (the kernel's receive time for SocketCAN).
+    */
+    private:
+        // Frames service() produced that write() didn't accept yet
+        vector<CANMessage> tx_backlog;
+        void transmit(const CANMessage *frames, int _count);
+    
+    public:
+        virtual ~GMLAN_Transport() { }
+        
+        // Read up to _max waiting frames without blocking, returns the number read
+        virtual int read(CANMessage *frames, int _max, uint64_t *timestamps = NULL) = 0;
+        // Queue frames for transmission, returns the number accepted
+        virtual int write(const CANMessage *frames, int _count) = 0;
+        // Add a receive filter in mbed's CAN::filter() form, handle 0 replaces any existing
+        // ones. Returns 0 on failure, so GMLAN_FilterPlanner::apply() can load a plan directly
+        virtual int filter(unsigned int /*id*/, unsigned int /*mask*/, CANFormat /*format*/ = CANAny, int /*handle*/ = 0) { return 0; }
+        // Block until a frame is waiting or _timeout_ms passes (-1 waits forever), returns true if
+        // one is. Backends that can't block return straight away and leave the caller polling
+        virtual bool wait(int /*_timeout_ms*/) { return true; }
+        
+        // Single frame helpers
+        bool write(const CANMessage &msg) { return write(&msg, 1) == 1; }
+        bool read(CANMessage &msg) { return read(&msg, 1) == 1; }
+        bool send(GMLAN_Message &msg) { return write(msg.generate()); }
+        
+        // Move one request along: start it, send whatever frames are due (batched up to the
+        // ECU's block size), flow control when needed, then feed it any received frames and
+        // check its receive timeout. Frames the backend can't take (a full queue) are kept and
+        // sent first on the next call. Returns the request's state
+        int service(GMLAN_11Bit_Request &request, uint32_t now_us);
+        // Frames service() is still holding for the backend
+        int backlog(void) { return tx_backlog.size(); }
+};
+
+class GMLAN_Loopback : public GMLAN_Transport {
+    /*
+    In-process bus for tests and simulations. Every frame written to one port is
+    delivered to each connected port (not back to the sender), subject to that
+    port's filters. Not thread safe, all ports are meant to live in one loop.
+    */
+    private:
+        struct Filter {
+            uint32_t id, mask;
+            CANFormat format;
+        };
+        struct Queued {
+            CANMessage msg;
+            uint64_t timestamp;
+        };
+        
+        vector<GMLAN_Loopback *> peers;
+        vector<Queued> queue;
+        size_t queue_head;
+        vector<Filter> filters;
+        uint32_t dropped, depth;
+        
+        bool accepts(const CANMessage &msg);
+        void deliver(const CANMessage &msg, uint64_t _timestamp);
+    
+    public:
+        // Main function, _depth frames can wait on each port before new ones are dropped
+        GMLAN_Loopback(uint32_t _depth = 1024) : queue_head(0), dropped(0), depth(_depth) { }
+        ~GMLAN_Loopback();
+        
+        // Join two ports (and transitively their bus)
+        void connect(GMLAN_Loopback &peer);
+        
+        virtual int read(CANMessage *frames, int _max, uint64_t *timestamps = NULL);
+        virtual int write(const CANMessage *frames, int _count);
+        virtual int filter(unsigned int id, unsigned int mask, CANFormat format = CANAny, int handle = 0);
+        using GMLAN_Transport::read;
+        using GMLAN_Transport::write;
+        
+        // Frames waiting, and frames lost to a full queue
+        uint32_t pending(void) { return queue.size() - queue_head; }
+        uint32_t overflows(void) { return dropped; }
+};
+
+#if DEVICE_CAN
+class GMLAN_CANTransport : public GMLAN_Transport {
+    /*
+    Adapter for mbed's own CAN peripheral
+    */
+    private:
+        CAN &can;
+    
+    public:
+        GMLAN_CANTransport(CAN &_can) : can(_can) { }
+        
+        virtual int read(CANMessage *frames, int _max, uint64_t *timestamps = NULL) {
+            int count = 0;
+            while ((count < _max) && can.read(frames[count])) {
+                if (timestamps != NULL) timestamps[count] = us_ticker_read();
+                count++;
+            }
+            return count;
+        }
+        virtual int write(const CANMessage *frames, int _count) {
+            int count = 0;
+            while ((count < _count) && can.write(frames[count])) count++;
+            return count;
+        }
+        virtual int filter(unsigned int id, unsigned int mask, CANFormat format = CANAny, int handle = 0) {
+            return can.filter(id, mask, format, handle);
+        }
+        using GMLAN_Transport::read;
+        using GMLAN_Transport::write;
+};
+#endif
+
+#endif
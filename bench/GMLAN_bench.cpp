@@ -0,0 +1,786 @@
+/*
+GMLAN_bench.cpp - Host microbenchmarks for the GMLAN Library
+
+Measures time per operation and heap allocations per operation for the header
+codec, message generation and the 11-bit ISO-TP request paths. Build with the
+host CMake project and run ./gmlan_bench, optionally passing an iteration count.
+*/
+
+#include "mbed.h"
+#include "GMLAN.h"
+#include "GMLAN_Async.h"
+#include "GMLAN_ChangeFilter.h"
+#include "GMLAN_DPIDStream.h"
+#include "GMLAN_Dispatcher.h"
+#include "GMLAN_MultiBus.h"
+#include "GMLAN_PIDCache.h"
+#include "GMLAN_Download.h"
+#include "GMLAN_Ring.h"
+#include "GMLAN_SessionManager.h"
+#include "GMLAN_Signals.h"
+#include "GMLAN_Simulator.h"
+#include "GMLAN_Scheduler.h"
+#include "GMLAN_Trace.h"
+#include "GMLAN_Transport.h"
+#include "GMLAN_TXQueue.h"
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// Count every trip through the global allocator so allocations per op can be reported
+static unsigned long long allocation_count = 0;
+
+void *operator new(std::size_t size) {
+    allocation_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+void *operator new[](std::size_t size) {
+    allocation_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+// Kept out of line: once free() is inlined into a caller GCC pairs it with the operator new
+// call it sees there and reports a mismatch (-Wmismatched-new-delete)
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, std::size_t) noexcept { operator delete[](p); }
+
+// Sink to stop the optimiser throwing away the work being measured
+static volatile unsigned int sink;
+
+// ops_per_call scales the figures for calls that process many items at once
+template <typename F>
+static void bench(const char *name, long iterations, F f, long ops_per_call = 1) {
+    // Warm up caches and any lazy initialisation before measuring
+    for (long i = 0; i < iterations / 10 + 1; i++) f(i);
+
+    unsigned long long allocs_before = allocation_count;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) f(i);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    unsigned long long allocs = allocation_count - allocs_before;
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    double ops = (double)iterations * ops_per_call;
+    printf("%-36s %12.2f ns/op %10.2f allocs/op\n", name, ns / ops, (double)allocs / ops);
+}
+
+static void count_handler(const CANHeader &hdr, const CANMessage &msg, void *context) {
+    (*(unsigned int *)context) += hdr.arbitration() + msg.len;
+}
+
+static bool count_send(const CANMessage &msg, void *context) {
+    (*(unsigned int *)context) += msg.id;
+    return true;
+}
+
+static void count_pid(int pid, const char *data, int length, void *context) {
+    (*(unsigned int *)context) += pid + data[0] + length;
+}
+
+// Frame as an ECU would send it back to the tester
+static CANMessage ecu_frame(int id, int b0, int b1, int b2, int b3, int b4, int b5, int b6, int b7) {
+    char data [8] = { (char)b0, (char)b1, (char)b2, (char)b3, (char)b4, (char)b5, (char)b6, (char)b7 };
+    return CANMessage(id, data, 8, CANData, CANStandard);
+}
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+// One ECU's VIN read as a coroutine, checks the answer (or the SIC's refusal) itself
+static GMLAN_Task scanECU(GMLAN_EventLoop &loop, int ecu, const std::vector<char> &request, int *done) {
+    GMLAN_Response vin = co_await loop.request(ecu, request);
+    if (ecu == GMLAN_TO_SIC) {
+        if (vin.ok() || (vin.nrc != GMLAN_NRC_REQUEST_OUT_OF_RANGE)) abort();
+    } else if (!vin.ok() || (vin.data.size() != 19)) abort();
+    (*done)++;
+}
+#endif
+
+// Endless stream of 29-bit frames with evenly spaced timestamps, stands in for a
+// busy interface so the multi-bus pipeline can be measured without hardware. Each
+// frame costs a bitwise CRC-15 over its header and payload plus a header decode,
+// roughly what a real read spends per frame in the driver and the caller
+class BenchFrameSource : public GMLAN_Transport {
+    private:
+        std::atomic<long> remaining;
+        uint64_t next_us, period_us;
+        uint32_t id;
+        uint32_t checksum;
+        
+        static uint16_t crc15(uint32_t _id, const unsigned char *_data, int _length) {
+            uint16_t crc = 0;
+            for (int i = 0; i < 29 + 8 * _length; i++) {
+                int bit = (i < 29) ? ((_id >> (28 - i)) & 1) : ((_data[(i - 29) >> 3] >> (7 - ((i - 29) & 7))) & 1);
+                bool flip = (((crc >> 14) & 1) ^ bit) != 0;
+                crc = (crc << 1) & 0x7FFF;
+                if (flip) crc ^= 0x4599;
+            }
+            return crc;
+        }
+
+    public:
+        BenchFrameSource(long frames, uint64_t start_us, uint64_t period, int arbitration) :
+            remaining(frames), next_us(start_us), period_us(period), id(gmlan_encode29bit(0x4, arbitration, 0x40)), checksum(0) { }
+        virtual int read(CANMessage *frames, int max, uint64_t *timestamps) {
+            long left = remaining.load(std::memory_order_relaxed);
+            int count = (left < max) ? (int)left : max;
+            for (int i = 0; i < count; i++) {
+                frames[i].id = id;
+                frames[i].len = 8;
+                frames[i].format = CANExtended;
+                frames[i].type = CANData;
+                memcpy(frames[i].data, &next_us, 8);
+                CANHeader hdr;
+                hdr.decode(frames[i].id);
+                checksum += crc15(frames[i].id, (const unsigned char *)frames[i].data, frames[i].len) + hdr.arbitration();
+                timestamps[i] = next_us;
+                next_us += period_us;
+            }
+            remaining.store(left - count, std::memory_order_relaxed);
+            return count;
+        }
+        virtual int write(const CANMessage * /*frames*/, int /*count*/) { return 0; }
+        bool finished(void) { return remaining.load(std::memory_order_relaxed) == 0; }
+        uint32_t getChecksum(void) { return checksum; }
+};
+
+// Completion callback that queues two replacements for each cancelled session
+struct BenchResubmit {
+    GMLAN_SessionManager *sessions;
+    std::vector<char> request;
+};
+static void resubmit(int /*handle*/, GMLAN_11Bit_Request &request, void *context) {
+    BenchResubmit *r = (BenchResubmit *)context;
+    if (request.getState() != GMLAN_STATE_ERROR) return;
+    for (int i = 0; i < 2; i++) {
+        if (r->sessions->submit(request.getID(), r->request) < 0) abort();
+    }
+}
+
+static void count_read(int /*id*/, int /*service*/, int /*identifier*/, const char * /*data*/, int length, void *context) {
+    if (length < 0) abort();
+    (*(long *)context)++;
+}
+
+int main(int argc, char **argv) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    bench("CANHeader::decode", iterations, [](long i) {
+        CANHeader hdr;
+        hdr.decode(0x100D0060 + (i & 0xFF));
+        sink = sink + hdr.arbitration() + hdr.sender();
+    });
+
+    bench("CANHeader::encode29bit", iterations, [](long i) {
+        CANHeader hdr;
+        hdr.priority(0x4);
+        hdr.arbitration(GMLAN_ARBID_STEERING_WHEEL_CONTROL_SWITCHES);
+        hdr.sender(i & 0xFF);
+        sink = sink + hdr.encode29bit();
+    });
+
+    bench("CANHeader::encode11bit", iterations, [](long i) {
+        CANHeader hdr;
+        hdr.arbitration(GMLAN_TO_BCM + (i & 0xF));
+        sink = sink + hdr.encode11bit();
+    });
+
+    bench("gmlan_id29 (compile time)", iterations, [](long i) {
+        sink = sink + gmlan_id29<0x4, GMLAN_ARBID_STEERING_WHEEL_CONTROL_SWITCHES, 0x60>::value + (i & 0xFF);
+    });
+
+    bench("GMLAN_Message::generate", iterations, [](long i) {
+        GMLAN_Message msg(0x4, GMLAN_ARBID_CHIME_COMMAND, 0x60, 0x01, i & 0xFF, 0x00, 0x00, 0x05);
+        CANMessage frame = msg.generate();
+        sink = sink + frame.id + frame.data[1];
+    });
+
+    bench("GMLAN_Message::generate (buffer)", iterations, [](long i) {
+        const char payload [5] = { 0x01, (char)(i & 0xFF), 0x00, 0x00, 0x05 };
+        GMLAN_Message msg(0x4, GMLAN_ARBID_CHIME_COMMAND, 0x60, payload, 5);
+        CANMessage frame = msg.generate();
+        sink = sink + frame.id + frame.data[1];
+    });
+
+    // Route a mix of broadcast frames through a dispatcher subscribed to every known
+    // low speed arbid below 0x280, plus one sender specific subscription
+    GMLAN_Dispatcher dispatcher;
+    static unsigned int dispatched = 0;
+    for (int arbid = GMLAN_ARBID_SYSTEM_POWER_MODE; arbid < GMLAN_ARBID_AIR_CONDITIONING_CONTROL; arbid += 3)
+        dispatcher.subscribe(arbid, count_handler, &dispatched);
+    dispatcher.subscribe(GMLAN_ARBID_STEERING_WHEEL_CONTROL_SWITCHES, count_handler, &dispatched, 0x60);
+    std::vector<CANMessage> broadcast;
+    for (int i = 0; i < 64; i++) {
+        GMLAN_Message msg(0x4, (i * 37) % GMLAN_ARBID_AIR_CONDITIONING_CONTROL, 0x40 + (i & 0x3F), i, 0x00, 0xFF);
+        broadcast.push_back(msg.generate());
+    }
+
+    bench("GMLAN_Dispatcher::dispatch", iterations, [&](long i) {
+        sink = sink + dispatcher.dispatch(broadcast[i & 63]);
+    });
+
+    // Four signals packed into one broadcast, decoded per frame and in bulk
+    const GMLAN_Signal signals [] = {
+        { GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 7, 15, true, false, 0.015625f, 0.0f, "speed" },
+        { GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 23, 15, true, false, 0.015625f, 0.0f, "distance" },
+        { GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 32, 8, false, true, 1.0f, -40.0f, "temperature" },
+        { GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 40, 1, false, false, 1.0f, 0.0f, "valid" },
+    };
+    GMLAN_SignalDecoder decoder(signals, 4);
+    std::vector<CANMessage> logged;
+    for (int i = 0; i < 4096; i++) {
+        GMLAN_Message msg(0x2, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 0x40, i >> 8, i & 0xFF, i & 0x7F, 0x10, i & 0xFF, 0x01);
+        logged.push_back(msg.generate());
+    }
+    static float values [GMLAN_SIGNALS_PER_FRAME];
+
+    bench("GMLAN_SignalDecoder::decode", iterations, [&](long i) {
+        sink = sink + decoder.decode(logged[i & 4095], values) + (int)values[0];
+    });
+
+    static float speed [4096], distance [4096], temperature [4096], valid [4096];
+    float *columns [4] = { speed, distance, temperature, valid };
+    bench("GMLAN_SignalDecoder::decodeBatch", iterations / 4096 + 1, [&](long) {
+        sink = sink + decoder.decodeBatch(&logged[0], 4096, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, columns);
+    }, 4096);
+
+    // 48 cyclic frames at 10ms to 5s periods, advanced one 1ms tick per poll
+    GMLAN_Scheduler cyclic;
+    const uint32_t periods [6] = { 10, 25, 100, 250, 1000, 5000 };
+    for (int i = 0; i < 48; i++)
+        cyclic.add(GMLAN_Message(0x4, GMLAN_ARBID_SYSTEM_POWER_MODE + i, 0x40, i).generate(), periods[i % 6], i);
+    static unsigned int cyclic_sent = 0;
+    static uint32_t cyclic_now = 0;
+
+    bench("GMLAN_Scheduler::poll (per 1ms tick)", iterations, [&](long) {
+        cyclic_now += 1000;
+        sink = sink + cyclic.poll(cyclic_now, count_send, &cyclic_sent);
+    });
+
+    // Capture the logged broadcasts plus a diagnostic conversation to a trace, then replay
+    // it flat out through the dispatcher and a request
+    const char *trace_path = "gmlan_bench.trace";
+    GMLAN_TraceWriter writer;
+    if (!writer.open(trace_path)) abort();
+    for (int i = 0; i < 4096; i++) writer.write(logged[i], (uint64_t)i * 1000);
+    writer.close();
+    GMLAN_TraceReader reader;
+    if (!reader.open(trace_path) || (reader.count() != 4096)) abort();
+    GMLAN_TraceReplay replay(reader);
+    replay.setDispatcher(&dispatcher);
+
+    bench("GMLAN_TraceReplay::run", iterations / 4096 + 1, [&](long) {
+        sink = sink + replay.run();
+    }, 4096);
+    uint32_t indexed;
+    if ((reader.find(GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, true, indexed) == NULL) || (indexed != 4096)) abort();
+    reader.close();
+    remove(trace_path);
+
+    // Twelve PIDs streamed as DPIDs, decoded from their $5xx frames
+    GMLAN_DPIDStream stream(GMLAN_TO_EBCM);
+    static unsigned int streamed = 0;
+    for (int pid = 0; pid < 12; pid++) stream.addPID(0x1200 + pid, 1 + (pid % 4));
+    stream.onData(count_pid, &streamed);
+    int dpid_count = stream.pack();
+    if (!stream.getUnpacked().empty()) abort();
+    std::vector<CANMessage> dpid_frames;
+    for (int d = 0; d < dpid_count; d++)
+        dpid_frames.push_back(ecu_frame(0x500 | (GMLAN_TO_EBCM & 0xFF), 0xFE - d, 1, 2, 3, 4, 5, 6, 7));
+
+    bench("GMLAN_DPIDStream::processFrame", iterations, [&](long i) {
+        sink = sink + stream.processFrame(dpid_frames[i % dpid_count]);
+    });
+
+    // Segmented request out (20 bytes -> first frame + 2 consecutive frames) and a
+    // segmented 30 byte response back (first frame + 4 consecutive frames)
+    std::vector<char> payload;
+    payload.push_back(GMLAN_SID_WRITE_DID);
+    for (int i = 1; i < 20; i++) payload.push_back(i);
+
+    std::vector<CANMessage> response;
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x30, 0x00, 0x00, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA));
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x10, 30, 0x7B, 0x01, 0x02, 0x03, 0x04, 0x05));
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x21, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C));
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x22, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13));
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x23, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A));
+    response.push_back(ecu_frame(GMLAN_MF_FROM_BCM, 0x24, 0x1B, 0x1C, 0x1D, 0xAA, 0xAA, 0xAA, 0xAA));
+
+    bench("GMLAN_11Bit_Request round trip", iterations / 10, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, payload);
+        req.start();
+        CANMessage frame = req.getNextFrame();
+        req.processFrame(response[0]);
+        while (req.getState() == GMLAN_STATE_SEND_DATA) frame = req.getNextFrame();
+        req.processFrame(response[1]);
+        if (req.getState() == GMLAN_STATE_SEND_FC) frame = req.getFlowControl();
+        for (size_t i = 2; i < response.size(); i++) req.processFrame(response[i]);
+        if (req.getState() != GMLAN_STATE_COMPLETED) abort();
+        sink = sink + req.getState() + req.getRXcount() + frame.id;
+    });
+
+    static char response_buffer [64];
+    bench("GMLAN_11Bit_Request RX into buffer", iterations / 10, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, payload);
+        req.setResponseBuffer(response_buffer, sizeof(response_buffer));
+        req.start();
+        req.getNextFrame();
+        req.processFrame(response[0]);
+        while (req.getState() == GMLAN_STATE_SEND_DATA) req.getNextFrame();
+        req.processFrame(response[1]);
+        req.getFlowControl();
+        for (size_t i = 2; i < response.size(); i++) req.processFrame(response[i]);
+        if (req.getResponseLength() != 30) abort();
+        sink = sink + req.getResponseData()[29];
+    });
+
+    // 256 byte transfer data request against an ECU asking for blocks of 8 frames
+    std::vector<char> transfer(256, 0x55);
+    transfer[0] = GMLAN_SID_DATA_TRANS;
+    CANMessage block_fc = ecu_frame(GMLAN_MF_FROM_BCM, 0x30, 0x08, 0x00, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA);
+
+    bench("GMLAN_11Bit_Request 256B paced TX", iterations / 10, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, transfer);
+        req.start();
+        CANMessage frame = req.getNextFrame();
+        while (req.getState() != GMLAN_STATE_AWAITING_REPLY) {
+            if (req.getState() == GMLAN_STATE_AWAITING_FC) req.processFrame(block_fc);
+            while (req.frameDue(0)) frame = req.getNextFrame();
+        }
+        sink = sink + frame.data[0];
+    });
+
+    static CANMessage burst [32];
+    bench("GMLAN_11Bit_Request 256B batch TX", iterations / 10, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, transfer);
+        req.start();
+        int frames = req.getFrames(burst, 32);
+        while (req.getState() != GMLAN_STATE_AWAITING_REPLY) {
+            if (req.getState() == GMLAN_STATE_AWAITING_FC) req.processFrame(block_fc);
+            frames += req.getFrames(burst, 32);
+        }
+        if (frames != 37) abort();
+        sink = sink + burst[0].data[0];
+    });
+
+    // 64KB image into a module that accepts every block straight away, per byte
+    std::vector<char> image(65536, 0x5A);
+    CANMessage dl_accept = ecu_frame(GMLAN_MF_FROM_EBCM, 0x01, 0x74, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA);
+    CANMessage block_accept = ecu_frame(GMLAN_MF_FROM_EBCM, 0x01, 0x76, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA);
+    CANMessage clear_to_send = ecu_frame(GMLAN_MF_FROM_EBCM, 0x30, 0x00, 0x00, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA);
+    GMLAN_Download download(GMLAN_TO_EBCM);
+
+    bench("GMLAN_Download 64KB image", 20, [&](long) {
+        download.begin(&image[0], image.size(), 0);
+        while (download.update(0) < GMLAN_DOWNLOAD_COMPLETED) {
+            GMLAN_11Bit_Request &req = download.getRequest();
+            int frames = req.getFrames(burst, 32);
+            if (req.getState() == GMLAN_STATE_AWAITING_FC) req.processFrame(clear_to_send);
+            else if (req.getState() == GMLAN_STATE_AWAITING_REPLY) req.processFrame((burst[0].data[1] == GMLAN_SID_DL_REQ) ? dl_accept : block_accept);
+            sink = sink + frames;
+        }
+        if (download.getState() != GMLAN_DOWNLOAD_COMPLETED) abort();
+    }, 65536);
+
+    // Interrupt side pushes a burst, main loop drains it into the request in one batch
+    static GMLAN_Ring<CANMessage, 64> ring;
+    bench("GMLAN_Ring push + drain round trip", iterations / 10, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, payload);
+        GMLAN_11Bit_Request *requests [1] = { &req };
+        req.start();
+        req.getNextFrame();
+        ring.push(response[0]);
+        ring.drain(requests, 1);
+        while (req.getState() == GMLAN_STATE_SEND_DATA) req.getNextFrame();
+        ring.push(response[1]);
+        ring.drain(requests, 1);
+        req.getFlowControl();
+        for (size_t i = 2; i < response.size(); i++) ring.push(response[i]);
+        ring.drain(requests, 1);
+        if (req.getState() != GMLAN_STATE_COMPLETED) abort();
+        sink = sink + req.getRXcount();
+    });
+    if (ring.overflows() != 0) abort();
+
+    // Read the VIN from seven ECUs at once, each answering with a 19 byte
+    // segmented response as soon as it sees the request / flow control
+    const int ecus [7] = { GMLAN_TO_BCM, GMLAN_TO_TDM, GMLAN_TO_EBCM, GMLAN_TO_EHU, GMLAN_TO_SIC, GMLAN_TO_IPC, GMLAN_TO_HVAC };
+    std::vector<char> read_vin;
+    read_vin.push_back(GMLAN_SID_REQ_DID);
+    read_vin.push_back(0x90);
+    std::vector<CANMessage> replies;
+    replies.reserve(16);
+
+    bench("GMLAN_SessionManager 7 ECU scan", iterations / 100, [&](long) {
+        GMLAN_SessionManager sessions;
+        for (int e = 0; e < 7; e++) sessions.submit(ecus[e], read_vin);
+        CANMessage msg;
+        while (sessions.active() > 0) {
+            replies.clear();
+            while (sessions.getNextFrame(msg)) {
+                int from = 0x600 | (msg.id & 0xFF);
+                if (msg.data[0] == 0x02) {
+                    replies.push_back(ecu_frame(from, 0x10, 19, 0x5A, 0x90, '1', 'G', '1', 'Z'));
+                } else if (msg.data[0] == 0x30) {
+                    replies.push_back(ecu_frame(from, 0x21, 'T', '5', '4', '8', '5', '4', 'F'));
+                    replies.push_back(ecu_frame(from, 0x22, '1', '2', '3', '4', '5', '6', 0xAA));
+                }
+            }
+            for (size_t r = 0; r < replies.size(); r++) sessions.processFrame(replies[r]);
+        }
+        for (int e = 0; e < 7; e++) {
+            if (sessions.getState(e) != GMLAN_STATE_COMPLETED) abort();
+            sink = sink + sessions.getRequest(e)->getRXcount();
+        }
+    });
+
+    // Seven sessions cancelled with release(), each completion queueing two more from
+    // inside release() so the session table grows under it
+    bench("GMLAN_SessionManager release + resubmit", iterations / 100, [&](long) {
+        GMLAN_SessionManager sessions;
+        BenchResubmit replace = { &sessions, read_vin };
+        int handles [7];
+        for (int e = 0; e < 7; e++) handles[e] = sessions.submit(ecus[e], read_vin);
+        sessions.onComplete(resubmit, &replace);
+        for (int e = 0; e < 7; e++) sessions.release(handles[e]);
+        sessions.onComplete(NULL);
+        int queued = 0;
+        // getRequest() is NULL for released slots and past the end of the table
+        for (int h = 0; h < 32; h++) {
+            if (sessions.getRequest(h) == NULL) continue;
+            if (sessions.getState(h) != GMLAN_STATE_READY_TO_SEND) abort();
+            queued++;
+        }
+        if ((queued != 14) || (sessions.active() != 14)) abort();
+    });
+
+    // Status broadcasts that mostly repeat: door status changes every 16th cycle, the
+    // speed frame every time, lighting and fuel never
+    static CANMessage status [256];
+    for (int i = 0; i < 256; i += 4) {
+        status[i] = GMLAN_Message(0x4, GMLAN_ARBID_DRIVER_DOOR_STATUS, 0x40, (i / 64) & 1).generate();
+        status[i + 1] = GMLAN_Message(0x4, GMLAN_ARBID_LIGHTING_STATUS, 0x40, (i / 256) & 1, 0x10).generate();
+        status[i + 2] = GMLAN_Message(0x2, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 0x60, i, 0x00).generate();
+        status[i + 3] = GMLAN_Message(0x6, GMLAN_ARBID_FUEL_INFORMATION, 0x60, 0x40, 0x12, 0x34).generate();
+    }
+    GMLAN_ChangeFilter changes(64, 0);
+
+    bench("GMLAN_ChangeFilter accept", iterations, [&](long i) {
+        sink = sink + changes.accept(status[i & 255], i);
+    });
+    printf("  %.1f%% of frames suppressed\n", changes.getSuppressionRatio() * 100.0f);
+    if (changes.getSuppressionRatio() < 0.5f) abort();
+
+    // A burst of text display frames queued ahead of a speed frame, which still goes first
+    GMLAN_TXQueue tx(GMLAN_BAUD_HS, 64);
+    CANMessage text = GMLAN_Message(0x6, GMLAN_ARBID_ARB_TEXT_REQ_SET_DISPLAY_TEXT, 0x60, 0x01, 'G', 'M', 'L', 'A', 'N').generate();
+    CANMessage speed_frame = GMLAN_Message(0x2, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION, 0x40, 0x00, 0x64).generate();
+
+    bench("GMLAN_TXQueue push + pop", iterations / 10, [&](long i) {
+        for (int f = 0; f < 31; f++) tx.push(text);
+        tx.push(speed_frame);
+        CANMessage msg;
+        if (!tx.pop(msg, i) || (msg.id != speed_frame.id)) abort();
+        while (tx.pop(msg, i)) sink = sink + msg.len;
+    }, 32);
+
+    // Same VIN read driven through a transport, with the ECU on the far end of a loopback
+    GMLAN_Loopback tester, ecu;
+    tester.connect(ecu);
+    ecu.filter(GMLAN_TO_BCM, 0x7FF, CANStandard);
+
+    bench("GMLAN_Transport loopback VIN read", iterations / 100, [&](long) {
+        GMLAN_11Bit_Request req(GMLAN_TO_BCM, read_vin);
+        CANMessage msg;
+        while ((tester.service(req, 0) != GMLAN_STATE_COMPLETED) && (req.getState() != GMLAN_STATE_ERROR)) {
+            while (ecu.read(msg)) {
+                if (msg.data[0] == 0x02) {
+                    ecu.write(ecu_frame(GMLAN_MF_FROM_BCM, 0x10, 19, 0x5A, 0x90, '1', 'G', '1', 'Z'));
+                } else if (msg.data[0] == 0x30) {
+                    CANMessage cf [2] = {
+                        ecu_frame(GMLAN_MF_FROM_BCM, 0x21, 'T', '5', '4', '8', '5', '4', 'F'),
+                        ecu_frame(GMLAN_MF_FROM_BCM, 0x22, '1', '2', '3', '4', '5', '6', 0xAA)
+                    };
+                    ecu.write(cf, 2);
+                }
+            }
+        }
+        if (req.getRXcount() != 19) abort();
+        sink = sink + req.getRXcount();
+    });
+    if ((tester.overflows() != 0) || (ecu.overflows() != 0)) abort();
+
+    // The seven ECU VIN scan again on a simulated 500k bus, already saturated with
+    // 29-bit broadcasts. The HVAC asks for more time twice, the SIC refuses
+    GMLAN_VirtualBus bus(GMLAN_BAUD_HS);
+    bus.setBroadcastLoad(1.0f, 0x2013);
+    std::vector<char> vin_reply(read_vin);
+    vin_reply[0] = GMLAN_SID_REQ_DID + 0x40;
+    const char *vin = "1G1ZT54854F123456";
+    vin_reply.insert(vin_reply.end(), vin, vin + 17);
+    std::vector<GMLAN_SimulatedECU> simulated;
+    for (int e = 0; e < 7; e++) simulated.push_back(GMLAN_SimulatedECU(ecus[e]));
+    for (int e = 0; e < 7; e++) {
+        if (ecus[e] == GMLAN_TO_SIC) simulated[e].addNegative(read_vin, GMLAN_NRC_REQUEST_OUT_OF_RANGE);
+        else simulated[e].addResponse(read_vin, vin_reply);
+        if (ecus[e] == GMLAN_TO_HVAC) simulated[e].setPending(2, 5000);
+        bus.attach(simulated[e]);
+    }
+    long simulated_requests = 0;
+
+    bench("GMLAN_VirtualBus 7 ECU scan, 100% load", iterations / 1000, [&](long) {
+        std::vector<GMLAN_11Bit_Request> scan;
+        for (int e = 0; e < 7; e++) scan.push_back(GMLAN_11Bit_Request(ecus[e], read_vin));
+        CANMessage frames [16];
+        int done = 0;
+        while (done < 7) {
+            done = 0;
+            for (int e = 0; e < 7; e++) {
+                GMLAN_11Bit_Request &req = scan[e];
+                if (req.getState() == GMLAN_STATE_READY_TO_SEND) req.start();
+                if (req.getState() == GMLAN_STATE_SEND_FC) bus.write(req.getFlowControl());
+                if (req.frameDue(bus.now())) bus.write(frames, req.getFrames(frames, 16, bus.now()));
+                if (req.getState() >= GMLAN_STATE_COMPLETED) done++;
+            }
+            bus.advance(100);
+            int count;
+            while ((count = bus.read(frames, 16)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    if (frames[i].format != CANStandard) continue;
+                    for (int e = 0; e < 7; e++) scan[e].processFrame(frames[i]);
+                }
+            }
+        }
+        for (int e = 0; e < 7; e++) {
+            int expected = (ecus[e] == GMLAN_TO_SIC) ? GMLAN_STATE_ERROR : GMLAN_STATE_COMPLETED;
+            if (scan[e].getState() != expected) abort();
+        }
+        simulated_requests += 7;
+    });
+    printf("  %.0f requests/s simulated, bus load %.1f%%, %u broadcast frames dropped, %u tester RX drops\n",
+        simulated_requests / (bus.now() / 1000000.0), bus.getBusLoad() * 100.0f, bus.getBroadcastDropped(), bus.getRXDropped());
+
+    // Three apps each reading the BCM's VIN and four live PIDs every cycle. The VIN
+    // comes off the bus once, the PIDs (not cached) in one packed $22 per cycle
+    const int live_pids [4] = { 0x000D, 0x000C, 0x0005, 0x000F };
+    const int live_lengths [4] = { 1, 2, 1, 1 };
+    std::vector<char> packed_request, packed_reply;
+    packed_request.push_back(GMLAN_SID_REQ_PID);
+    packed_reply.push_back(GMLAN_SID_REQ_PID + 0x40);
+    for (int p = 0; p < 4; p++) {
+        packed_request.push_back(live_pids[p] >> 8);
+        packed_request.push_back(live_pids[p] & 0xFF);
+        packed_reply.push_back(live_pids[p] >> 8);
+        packed_reply.push_back(live_pids[p] & 0xFF);
+        for (int b = 0; b < live_lengths[p]; b++) packed_reply.push_back(0x10 + p);
+    }
+    GMLAN_VirtualBus pid_bus(GMLAN_BAUD_HS);
+    GMLAN_SimulatedECU pid_ecu(GMLAN_TO_BCM);
+    pid_ecu.addResponse(read_vin, vin_reply);
+    pid_ecu.addResponse(packed_request, packed_reply);
+    pid_bus.attach(pid_ecu);
+    GMLAN_SessionManager pid_sessions;
+    GMLAN_PIDCache pid_values(pid_sessions);
+    pid_values.setMaxPIDs(GMLAN_TO_BCM, 4);
+    for (int p = 0; p < 4; p++) {
+        pid_values.setPIDLength(live_pids[p], live_lengths[p]);
+        pid_values.setTTL(GMLAN_SID_REQ_PID, live_pids[p], 0);
+    }
+    long values_read = 0, pid_rounds = 0;
+
+    bench("GMLAN_PIDCache 3 apps x 5 values", iterations / 1000, [&](long) {
+        for (int app = 0; app < 3; app++) {
+            pid_values.read(GMLAN_TO_BCM, GMLAN_SID_REQ_DID, GMLAN_DID_VIN, count_read, &values_read);
+            for (int p = 0; p < 4; p++) pid_values.read(GMLAN_TO_BCM, GMLAN_SID_REQ_PID, live_pids[p], count_read, &values_read);
+        }
+        CANMessage msg;
+        while (pid_values.pending() > 0) {
+            pid_values.update();
+            while (pid_sessions.getNextFrame(msg)) pid_bus.write(msg);
+            pid_bus.advance(100);
+            while (pid_bus.read(msg)) pid_sessions.processFrame(msg);
+        }
+        pid_rounds++;
+    });
+    printf("  %ld values from %u bus transactions, %u cache hits, %u coalesced\n",
+        values_read, pid_values.getTransactions(), pid_values.getHits(), pid_values.getCoalesced());
+    if ((pid_values.getTransactions() != 1 + pid_rounds) || (values_read != 15 * pid_rounds)) abort();
+
+    // The same four PIDs from an IPC that refuses packed requests: each round the
+    // packed $22 comes back negative and the cache falls back to one PID at a time
+    GMLAN_VirtualBus refusing_bus(GMLAN_BAUD_HS);
+    GMLAN_SimulatedECU refusing_ecu(GMLAN_TO_IPC);
+    refusing_ecu.addNegative(packed_request, GMLAN_NRC_REQUEST_OUT_OF_RANGE);
+    for (int p = 0; p < 4; p++) {
+        std::vector<char> single(packed_request.begin(), packed_request.begin() + 1);
+        single.push_back(live_pids[p] >> 8);
+        single.push_back(live_pids[p] & 0xFF);
+        std::vector<char> reply(single);
+        reply[0] = GMLAN_SID_REQ_PID + 0x40;
+        for (int b = 0; b < live_lengths[p]; b++) reply.push_back(0x10 + p);
+        refusing_ecu.addResponse(single, reply);
+    }
+    refusing_bus.attach(refusing_ecu);
+    GMLAN_SessionManager refusing_sessions;
+    GMLAN_PIDCache refusing_values(refusing_sessions);
+    refusing_values.setMaxPIDs(GMLAN_TO_IPC, 4);
+    for (int p = 0; p < 4; p++) {
+        refusing_values.setPIDLength(live_pids[p], live_lengths[p]);
+        refusing_values.setTTL(GMLAN_SID_REQ_PID, live_pids[p], 0);
+    }
+    long refused_read = 0, refused_rounds = 0;
+
+    bench("GMLAN_PIDCache packed refused", iterations / 1000, [&](long) {
+        for (int app = 0; app < 3; app++) {
+            for (int p = 0; p < 4; p++) refusing_values.read(GMLAN_TO_IPC, GMLAN_SID_REQ_PID, live_pids[p], count_read, &refused_read);
+        }
+        CANMessage msg;
+        while (refusing_values.pending() > 0) {
+            refusing_values.update();
+            while (refusing_sessions.getNextFrame(msg)) refusing_bus.write(msg);
+            refusing_bus.advance(100);
+            while (refusing_bus.read(msg)) refusing_sessions.processFrame(msg);
+        }
+        refused_rounds++;
+    });
+    if ((refusing_values.getTransactions() != 5 * refused_rounds) || (refused_read != 12 * refused_rounds)) abort();
+
+    // A 250 byte read from the BCM that loses a consecutive frame every time. The
+    // gap shows up on the following frame and the read goes out again straight away
+    std::vector<char> long_request, long_reply;
+    long_request.push_back(GMLAN_SID_REQ_DID);
+    long_request.push_back(0xB0);
+    long_reply.push_back(GMLAN_SID_REQ_DID + 0x40);
+    long_reply.push_back(0xB0);
+    for (int b = 0; b < 248; b++) long_reply.push_back(b);
+    GMLAN_VirtualBus lossy_bus(GMLAN_BAUD_HS);
+    GMLAN_SimulatedECU lossy_ecu(GMLAN_TO_BCM);
+    lossy_ecu.addResponse(long_request, long_reply);
+    lossy_bus.attach(lossy_ecu);
+    GMLAN_SessionManager lossy_sessions;
+    long lossy_reads = 0;
+
+    bench("GMLAN_SessionManager lost frame retry", iterations / 1000, [&](long) {
+        lossy_ecu.setDropFrame(20);
+        int handle = lossy_sessions.submit(GMLAN_TO_BCM, long_request);
+        CANMessage msg;
+        while (lossy_sessions.active() > 0) {
+            while (lossy_sessions.getNextFrame(msg)) lossy_bus.write(msg);
+            lossy_bus.advance(100);
+            while (lossy_bus.read(msg)) lossy_sessions.processFrame(msg);
+        }
+        GMLAN_11Bit_Request *req = lossy_sessions.getRequest(handle);
+        if ((req->getState() != GMLAN_STATE_COMPLETED) || (req->getResponseLength() != 250)) abort();
+        if (memcmp(req->getResponseData(), &long_reply[0], 250) != 0) abort();
+        lossy_sessions.release(handle);
+        lossy_reads++;
+    });
+    printf("  %.2f ms per read including the retry, %d retries\n",
+        lossy_bus.now() / 1000.0 / lossy_reads, lossy_sessions.getRetried());
+    if (lossy_sessions.getRetried() != lossy_reads) abort();
+
+    // The same read answered after two 0x78 "still processing" replies 20ms apart,
+    // with a 5ms N_Cr. Only the gaps between consecutive frames count against it
+    GMLAN_VirtualBus pending_bus(GMLAN_BAUD_HS);
+    GMLAN_SimulatedECU pending_ecu(GMLAN_TO_BCM);
+    pending_ecu.addResponse(long_request, long_reply);
+    pending_ecu.setPending(2, 20000);
+    pending_bus.attach(pending_ecu);
+    GMLAN_11Bit_Request pending_read(GMLAN_TO_BCM, long_request);
+    pending_read.setReceiveTimeout(5000);
+
+    bench("GMLAN_11Bit_Request 0x78 pending + N_Cr", iterations / 1000, [&](long) {
+        pending_read.reset();
+        while (pending_bus.service(pending_read, pending_bus.now()) < GMLAN_STATE_COMPLETED) pending_bus.advance(100);
+        if ((pending_read.getState() != GMLAN_STATE_COMPLETED) || (pending_read.getResponseLength() != 250)) abort();
+    });
+
+#if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902L)
+    // The same scan written as seven coroutines on one event loop
+    GMLAN_EventLoop loop(bus);
+
+    bench("GMLAN_EventLoop 7 ECU scan, 100% load", iterations / 1000, [&](long) {
+        int done = 0;
+        for (int e = 0; e < 7; e++) loop.spawn(scanECU(loop, ecus[e], read_vin, &done));
+        while (loop.active() > 0) {
+            loop.poll();
+            bus.advance(100);
+        }
+        if (done != 7) abort();
+    });
+#endif
+
+#if defined(__linux__)
+    // Merged frames/s from one to four buses, each on its own worker thread, so the
+    // per-frame read cost is spread over as many workers as there are buses. The
+    // sources space frames like a busy HS bus but turn out seconds of bus time per
+    // millisecond of CPU, so a worker waiting for the core falls far behind in
+    // timestamp terms. The skew covers the whole run and every bus ends at the
+    // same time, so the merge has to come out exactly in order. Scaling only shows
+    // with spare cores: with one core the workers take turns and the rate stays flat
+    printf("GMLAN_MultiBus hardware threads: %u\n", std::thread::hardware_concurrency());
+    double single_rate = 0;
+    static const char *multibus_names [GMLAN_MULTIBUS_MAX] = {
+        "GMLAN_MultiBus merge, 1 bus", "GMLAN_MultiBus merge, 2 buses",
+        "GMLAN_MultiBus merge, 3 buses", "GMLAN_MultiBus merge, 4 buses"
+    };
+    for (int count = 1; count <= GMLAN_MULTIBUS_MAX; count++) {
+        const uint64_t span_us = 500000ULL * 250;
+        BenchFrameSource *sources [GMLAN_MULTIBUS_MAX];
+        GMLAN_MultiBus buses;
+        buses.setMaxSkew(span_us);
+        long expected = 0;
+        for (int b = 0; b < count; b++) {
+            // Different rates and phases so the merge has real interleaving to do
+            uint64_t period_us = 250 + 50 * b;
+            long frames = span_us / period_us;
+            sources[b] = new BenchFrameSource(frames, b, period_us, GMLAN_ARBID_VEHICLE_SPEED_INFORMATION + b);
+            buses.addBus(*sources[b], GMLAN_BAUD_HS);
+            expected += frames;
+        }
+        auto start = std::chrono::steady_clock::now();
+        buses.start();
+        GMLAN_BusFrame merged [64];
+        uint64_t last = 0;
+        long total = 0;
+        while (total < expected) {
+            bool done = true;
+            for (int b = 0; b < count; b++) done = done && sources[b]->finished();
+            if (done) buses.flush();
+            int n = buses.next(merged, 64);
+            if (n == 0) std::this_thread::yield();
+            for (int i = 0; i < n; i++) {
+                if (merged[i].timestamp_us < last) abort();
+                last = merged[i].timestamp_us;
+            }
+            total += n;
+        }
+        buses.stop();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = total / seconds;
+        if (count == 1) single_rate = rate;
+        printf("%-36s %12.0f frames/s %6.2fx\n", multibus_names[count - 1], rate, rate / single_rate);
+        for (int b = 0; b < count; b++) {
+            if (buses.getDropped(b) != 0) abort();
+            sink = sink + sources[b]->getChecksum();
+            delete sources[b];
+        }
+    }
+#endif
+
+#ifdef GMLAN_INSTRUMENTATION
+    // Latency seen by the loopback VIN reads above
+    const GMLAN_ECULatency *bcm = gmlan_latency.getECU(GMLAN_TO_BCM);
+    if ((bcm == NULL) || (bcm->completed == 0)) abort();
+    printf("BCM first frame p50 %u us p99 %u us, total p50 %u us p99 %u us over %u requests\n",
+        bcm->first_frame.percentile(50), bcm->first_frame.percentile(99),
+        bcm->total.percentile(50), bcm->total.percentile(99), bcm->completed);
+#endif
+
+    return 0;
+}
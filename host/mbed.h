@@ -0,0 +1,84 @@
+/*
+mbed.h - Host shim for building the GMLAN Library off-target
+
+The library is written against the mbed CAN API. This header provides just
+enough of it (CANMessage, CANFormat, CANType and the microsecond ticker) for
+the library to compile and run on a Linux host, so it can be benchmarked and
+exercised without flashing a board. It is only ever on the include path of the
+host build, an mbed build picks up the real mbed.h instead.
+*/
+
+#ifndef MBED_H
+#define MBED_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <cstddef>
+
+enum CANFormat {
+    CANStandard = 0,
+    CANExtended = 1,
+    CANAny = 2
+};
+
+enum CANType {
+    CANData = 0,
+    CANRemote = 1
+};
+
+struct CAN_Message {
+    unsigned int id;
+    unsigned char data[8];
+    unsigned char len;
+    CANFormat format;
+    CANType type;
+};
+
+class CANMessage : public CAN_Message {
+    /*
+    Mirrors mbed's CANMessage: a plain frame with an inline 8 byte payload
+    */
+    public:
+        CANMessage() {
+            len = 8;
+            type = CANData;
+            format = CANStandard;
+            id = 0;
+            memset(data, 0, 8);
+        }
+
+        CANMessage(int _id, const char *_data, char _len = 8, CANType _type = CANData, CANFormat _format = CANStandard) {
+            len = (_len > 8) ? 8 : _len;
+            type = _type;
+            format = _format;
+            id = _id;
+            memcpy(data, _data, len);
+        }
+
+        CANMessage(int _id, CANFormat _format = CANStandard) {
+            len = 0;
+            type = CANRemote;
+            format = _format;
+            id = _id;
+            memset(data, 0, 8);
+        }
+};
+
+// Free running microsecond counter, wraps like the hardware ticker does
+inline uint32_t us_ticker_read(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+inline void wait_us(int us) {
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000L;
+    nanosleep(&ts, NULL);
+}
+
+using namespace std;
+
+#endif